@@ -22,6 +22,7 @@
 #include <string.h>
 
 #include "adc.h"
+#include "filter.h"
 #include "features.h"
 #include "moat.h"
 #include "dev_data.h"
@@ -34,23 +35,19 @@ adc_t adcs[] = {
 #include "_adc.h"
 };
 
-/* Each mainloop pass checks one adc. */
-static uint8_t poll_this = 0;
-static uint8_t poll_step = 0;
-static uint8_t max_seen = 0;
 /* Number of highest adc that has a change +1  */
 uint8_t adc_changed_cache;
+static uint8_t max_seen = 0;
 
-static inline char adc_check(adc_t *pp)
+/* ADMUX setting for an adc, or 0xFF if it can't be read */
+static inline uint8_t adc_mux(adc_t *pp)
 {
 	uint8_t x;
-	uint16_t val;
-	switch(poll_step++) {
-	case 0:
-		if (pp->flags & ADC_REF)
-			x = (1<<REFS1) | (1<<REFS0) | (1<<ADLAR);
-		else
-			x = (1<<REFS0) |              (1<<ADLAR);
+
+	if (pp->flags & ADC_REF)
+		x = (1<<REFS1) | (1<<REFS0) | (1<<ADLAR);
+	else
+		x = (1<<REFS0) |              (1<<ADLAR);
 #ifdef __AVR_ATtiny84__
 #define _VGND 0x20
 #define _VBG 0x21
@@ -66,22 +63,230 @@ static inline char adc_check(adc_t *pp)
 #define _VTEMP 0x08
 #endif
 
-		if (!(pp->flags & ADC_ALT)) 
-			x |= pp->flags&ADC_MASK;
-		else switch(pp->flags & ADC_MASK) {
-		case ADC_VBG:
-			x |= _VBG; break;
-		case ADC_VGND:
-			x |= _VGND; break;
-		case ADC_VTEMP:
-			x |= _VTEMP; break;
-		default:
-			poll_step = 0;
-			return 1;
-		}
+	if (!(pp->flags & ADC_ALT)) 
+		x |= pp->flags&ADC_MASK;
+	else switch(pp->flags & ADC_MASK) {
+	case ADC_VBG:
+		x |= _VBG; break;
+	case ADC_VGND:
+		x |= _VGND; break;
+	case ADC_VTEMP:
+		x |= _VTEMP; break;
+	default:
+		return 0xFF;
+	}
 #undef _VGND
 #undef _VBG
 #undef _VTEMP
+	return x;
+}
+
+#ifdef N_ADC_OS
+/*
+ * An oversampled adc adds up 4^n conversions and divides the sum by 2^n,
+ * which yields n more bits. This works because the readings are noisy;
+ * a perfectly stable input doesn't gain anything.
+ */
+typedef struct {
+	uint32_t sum;
+	uint16_t left; // conversions still to add
+} adc_os_t;
+
+static const uint8_t adc_os_idx[] __attribute__ ((progmem)) = { ADC_OS_IDX };
+static const uint8_t adc_os_bits[] __attribute__ ((progmem)) = { ADC_OS_BITS };
+static adc_os_t adc_os[N_ADC_OS];
+#endif
+
+#ifdef N_ADC_FLT
+static const uint8_t adc_flt_idx[] __attribute__ ((progmem)) = { ADC_FLT_IDX };
+static const uint8_t adc_flt_mode[] __attribute__ ((progmem)) = { ADC_FLT_MODE };
+static filter_t adc_flt[N_ADC_FLT];
+#ifdef ADC_FLT_BUF
+static const uint8_t adc_flt_off[] __attribute__ ((progmem)) = { ADC_FLT_OFF };
+static uint16_t adc_flt_buf[ADC_FLT_BUF];
+#endif
+#endif
+
+static inline void adc_store(uint8_t i, uint16_t val)
+{
+	adc_t *pp = &adcs[i];
+#ifdef N_ADC_OS
+	uint8_t c = pgm_read_byte(&adc_os_idx[i]);
+
+	if (c) {
+		adc_os_t *os = &adc_os[--c];
+		uint8_t n = pgm_read_byte(&adc_os_bits[c]);
+
+		os->sum += val>>6;
+		if (--os->left)
+			goto done;
+		val = (os->sum >> n) << (6-n);
+		val |= val>>(10+n);
+		os->sum = 0;
+		os->left = 1<<(2*n);
+	} else
+#endif
+	val |= val>>10; // fill the lower bits, so that max=0xFFFF
+#ifdef N_ADC_FLT
+	{
+		uint8_t f = pgm_read_byte(&adc_flt_idx[i]);
+		if (f--) {
+#ifdef ADC_FLT_BUF
+			uint16_t *buf = &adc_flt_buf[pgm_read_byte(&adc_flt_off[f])];
+#else
+			uint16_t *buf = NULL;
+#endif
+			val = filter_step(&adc_flt[f], pgm_read_byte(&adc_flt_mode[f]), buf, val);
+		}
+	}
+#endif
+	pp->value = val;
+	if (pp->flags & ADC_ALERT) {
+		if (pp->lower != 0xFFFF && pp->value <= pp->lower)
+			pp->flags |= ADC_IS_ALERT_L;
+		if (pp->upper != 0x0000 && pp->value >= pp->upper)
+			pp->flags |= ADC_IS_ALERT_H;
+	}
+#ifdef N_ADC_OS
+done:
+#endif
+	if (pp->flags & (ADC_IS_ALERT_L|ADC_IS_ALERT_H))
+		max_seen = i+1;
+	if (i == N_ADC-1) {
+		adc_changed_cache = max_seen;
+		max_seen = 0;
+	}
+}
+
+#ifdef HAVE_ADC_IRQ
+
+/*
+ * The ADC runs continuously, in free-running mode, and interrupts when a
+ * conversion is done. By then the next conversion has already started,
+ * so the MUX setting we write now applies to the one after that: the
+ * result always belongs to the adc selected two interrupts earlier.
+ *
+ * Switching to another reference, or to one of the internal sources,
+ * needs time to settle. Such an adc is converted twice in a row; the
+ * first result is thrown away.
+ *
+ * The handler selects the next adc with interrupts off, then stores the
+ * result with interrupts on. If the next conversion is done before that
+ * has finished, the nested handler leaves its result for the outer one.
+ */
+#if F_CPU > 12800000
+#define ADC_PS 7 // ADC clock must be 50…200 kHz
+#elif F_CPU > 6400000
+#define ADC_PS 6
+#elif F_CPU > 3200000
+#define ADC_PS 5
+#elif F_CPU > 1600000
+#define ADC_PS 4
+#else
+#define ADC_PS 3
+#endif
+
+#define ADC_DISCARD 0x80
+static uint8_t adc_run;  // adc being converted
+static uint8_t adc_next; // adc selected in ADMUX
+static uint8_t adc_pos;  // adc to select next
+static volatile uint8_t adc_busy; // 1: storing, 2: another result is waiting
+static uint8_t adc_wait_i;
+static uint16_t adc_wait_val;
+
+#define ADMUX_REFS ((1<<REFS1)|(1<<REFS0))
+
+static uint8_t adc_select(void)
+{
+	uint8_t i = adc_pos;
+	uint8_t n = N_ADC;
+	uint8_t mux, old;
+
+	do {
+		if (i >= N_ADC)
+			i = 0;
+		mux = adc_mux(&adcs[i]);
+		if (mux != 0xFF)
+			break;
+		i++;
+	} while(--n);
+	if (!n) // nothing to read
+		return ADC_DISCARD;
+
+	old = ADMUX;
+	ADMUX = mux;
+	if (mux != old && (((mux ^ old) & ADMUX_REFS) || (adcs[i].flags & ADC_ALT))) {
+		adc_pos = i; // again, for real
+		return i | ADC_DISCARD;
+	}
+	adc_pos = i+1;
+	return i;
+}
+
+ISR(ADC_vect)
+{
+	uint16_t val;
+	uint8_t i = adc_run;
+
+	val = ADCL;
+	val |= ADCH<<8;
+	adc_run = adc_next;
+	adc_next = adc_select();
+	if (i & ADC_DISCARD)
+		return;
+	if (adc_busy) {
+		adc_wait_i = i;
+		adc_wait_val = val;
+		adc_busy = 2;
+		return;
+	}
+	adc_busy = 1;
+	sei();
+	for(;;) {
+		adc_store(i, val);
+		cli();
+		if (adc_busy == 1)
+			break;
+		i = adc_wait_i;
+		val = adc_wait_val;
+		adc_busy = 1;
+		sei();
+	}
+	adc_busy = 0;
+}
+
+void poll_adc(void)
+{
+	// all work is done by the interrupt handler
+}
+
+static inline void init_adc_irq(void)
+{
+	adc_pos = 0;
+	adc_run = ADC_DISCARD;
+	ADMUX = 0xFF; // anything else counts as a change
+	adc_next = adc_select();
+	ADCSRB &=~ ((1<<ADTS2)|(1<<ADTS1)|(1<<ADTS0)); // free running
+	ADCSRA = (1<<ADEN)|(1<<ADSC)|(1<<ADATE)|(1<<ADIF)|(1<<ADIE)|ADC_PS;
+}
+
+#else // !HAVE_ADC_IRQ
+
+/* Each mainloop pass checks one adc. */
+static uint8_t poll_this = 0;
+static uint8_t poll_step = 0;
+
+static inline char adc_check(uint8_t i)
+{
+	uint8_t x;
+	uint16_t val;
+	switch(poll_step++) {
+	case 0:
+		x = adc_mux(&adcs[i]);
+		if (x == 0xFF) {
+			poll_step = 0;
+			return 1;
+		}
 		ADMUX = x;
 		ADCSRA = (1<<ADEN)|(1<<ADIF)|0x07; // slow
 		break;
@@ -94,14 +299,7 @@ static inline char adc_check(adc_t *pp)
 			break;
 		val = ADCL;
 		val |= ADCH<<8;
-		val |= val>>10; // fill the lower bits, so that max=0xFFFF
-		pp->value = val;
-		if (pp->flags & ADC_ALERT) {
-			if (pp->lower != 0xFFFF && pp->value <= pp->lower)
-				pp->flags |= ADC_IS_ALERT_L;
-			if (pp->upper != 0x0000 && pp->value >= pp->upper)
-				pp->flags |= ADC_IS_ALERT_H;
-		}
+		adc_store(i, val);
 		poll_step = 0;
 		return 1;
 	}
@@ -111,22 +309,16 @@ static inline char adc_check(adc_t *pp)
 void poll_adc(void)
 {
 	uint8_t i = poll_this;
-	adc_t *pp;
 
-	if (i >= N_ADC) {
+	if (i >= N_ADC)
 		i=0;
-		adc_changed_cache = max_seen;
-		max_seen=0;
-	}
-	pp = &adcs[i];
-	if (adc_check(pp)) {
+	if (adc_check(i))
 		i += 1;
-		if (pp->flags & (ADC_IS_ALERT_L|ADC_IS_ALERT_H))
-			max_seen = i;
-	}
 	poll_this=i;
 }
 
+#endif // HAVE_ADC_IRQ
+
 void init_adc(void)
 {
 	adc_t *pp = adcs;
@@ -154,6 +346,17 @@ void init_adc(void)
 #endif
 		pp++;
 	}
+#ifdef N_ADC_OS
+	for(i=0;i<N_ADC_OS;i++)
+		adc_os[i].left = 1<<(2*pgm_read_byte(&adc_os_bits[i]));
+#endif
+#ifdef N_ADC_FLT
+	for(i=0;i<N_ADC_FLT;i++)
+		filter_init(&adc_flt[i]);
+#endif
+#ifdef HAVE_ADC_IRQ
+	init_adc_irq();
+#endif
 }
 
 
@@ -18,6 +18,8 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
 #include "pgm.h"
 #include <string.h>
 
@@ -28,6 +30,7 @@
 #include "dev_data.h"
 #include "debug.h"
 #include "timer.h"
+#include "adc.h"
 #include "moat_internal.h"
 
 #ifdef N_COUNT
@@ -41,14 +44,365 @@ uint8_t count_changed_cache;
 static uint8_t max_seen = 0;
 #endif
 
+#ifdef COUNT_TIMER1
+/*
+ * Timer1 counts pulses on its clock input by itself. We add the difference
+ * since the last poll, which extends its 16-bit count. That works as long
+ * as every counter gets polled before 65536 pulses arrive.
+ */
+static uint16_t t1_last;
+
+static inline char poll_count_timer1(count_t *t)
+{
+	uint16_t now, d;
+	uint8_t sreg = SREG;
+
+	cli();
+	now = TCNT1;
+	SREG = sreg;
+	d = now - t1_last;
+	if (!d)
+		return 0;
+	t1_last = now;
+	t->count += d;
+	return 1;
+}
+
+static inline void init_count_timer1(void)
+{
+	TCCR1A = 0;
+	TCNT1 = 0;
+	t1_last = 0;
+	// external clock on T1, falling (6) or rising (7) edge
+	TCCR1B = (counts[COUNT_TIMER1].flags & CF_RISING_ONLY) ? 0x07 : 0x06;
+}
+#endif
+
+#ifdef N_COUNT_RATE
+#ifndef HAVE_TIMER
+#error "Measuring rates requires a timer"
+#endif
+/*
+ * Rates are measured between edges: from the last edge seen in one gate
+ * period to the last edge seen in a later one. This is accurate for slow
+ * and fast inputs alike. Interrupt-driven counters record each edge's
+ * time; for the others, we only know when the main loop noticed it.
+ *
+ * Time is kept in a 32-bit extension of timer_ticks().
+ */
+#define TICKS_PER_SEC (F_CPU/TIMER_PRESCALE)
+#define GATE ((uint32_t)COUNT_GATE*TICKS_PER_SEC/10)
+#define GATE_MAX (4*GATE) // no edges for this long: rate is zero
+
+typedef struct {
+	count_val_t c0, cn; // count at the start, and at the latest edge
+	uint32_t t0, tn; // clock at these edges
+	uint32_t rate;
+	uint32_t lo, hi; // alert limits
+	uint16_t stamp; // timer_ticks() of the latest edge, from count_irq()
+	uint8_t out; // rate is outside the limits
+} count_rate_t;
+
+static const uint8_t count_rate_idx[] __attribute__ ((progmem)) = { COUNT_RATE_IDX };
+static count_rate_t count_rates[N_COUNT_RATE];
+static uint32_t count_clock;
+static uint16_t count_clock_last;
+
+static count_rate_t *count_rate_of(count_t *t)
+{
+	return &count_rates[pgm_read_byte(&count_rate_idx[t-counts])-1];
+}
+
+uint32_t count_rate(count_t *t)
+{
+	return (t->flags & CF_RATE) ? count_rate_of(t)->rate : 0;
+}
+
+void count_rate_limits(count_t *t, uint32_t lo, uint32_t hi)
+{
+	count_rate_t *r = count_rate_of(t);
+	r->lo = lo;
+	r->hi = hi;
+	r->out = 0;
+}
+
+/* Returns 1 if the rate has just left its limits. */
+static char poll_count_rate(count_t *t, uint16_t now)
+{
+	count_rate_t *r = count_rate_of(t);
+	count_val_t n;
+	uint16_t s;
+	uint32_t d, dt, q;
+	uint8_t out;
+	uint8_t sreg = SREG;
+
+	cli();
+	n = t->count;
+	s = r->stamp;
+	SREG = sreg;
+	if (n != r->cn) {
+		r->cn = n;
+		r->tn = count_clock;
+		if (t->flags & CF_IRQ)
+			r->tn -= (uint16_t)(now - s);
+	}
+	if (count_clock - r->t0 < GATE)
+		return 0;
+
+	d = (count_val_t)(r->cn - r->c0);
+	if (!d) {
+		if (count_clock - r->t0 < GATE_MAX)
+			return 0;
+		r->rate = 0;
+		r->t0 = count_clock;
+	} else {
+		dt = r->tn - r->t0;
+		if (!dt)
+			dt = 1;
+		if (d > 0xFFFFFFFF/TICKS_PER_SEC) {
+			r->rate = 0xFFFFFFFF;
+		} else {
+			// 24.8 fixed point, without 64-bit arithmetic
+			d *= TICKS_PER_SEC;
+			q = d / dt;
+			r->rate = (q<<8) | (((d - q*dt)<<8) / dt);
+		}
+		r->c0 = r->cn;
+		r->t0 = r->tn;
+	}
+
+	out = (r->lo && r->rate < r->lo) || (r->hi && r->rate > r->hi);
+	if (out == r->out)
+		return 0;
+	r->out = out;
+	return out;
+}
+
+static inline void init_count_rate(void)
+{
+	uint8_t i;
+	count_t *t = counts;
+
+	count_clock_last = timer_ticks();
+	memset(count_rates,0,sizeof(count_rates));
+	for(i=0;i<N_COUNT;i++,t++)
+		if (t->flags & CF_RATE)
+			count_rate_of(t)->c0 = count_rate_of(t)->cn = t->count;
+}
+#endif // N_COUNT_RATE
+
+#ifdef COUNT_IRQ_BITS
+/*
+ * Count edges as they happen, instead of relying on poll_port() to see
+ * them. Runs with interrupts enabled, but port_irq() masks the bank's pin
+ * change interrupt, so a nested edge can't interfere with the update. The
+ * main loop reads counters with interrupts off.
+ */
+static const uint8_t count_irq_mask[PORT_BANKS] = { COUNT_IRQ_MASKS };
+static const uint8_t count_bits[] __attribute__ ((progmem)) = { COUNT_IRQ_BITS };
+
+void count_irq(uint8_t bank, uint8_t d, uint8_t pin, uint16_t now)
+{
+	const uint8_t *cb = &count_bits[bank<<3];
+
+	d &= count_irq_mask[bank];
+	while(d) {
+		if (d & 1) {
+			count_t *t = &counts[pgm_read_byte(cb)-1];
+			uint8_t flg = t->flags;
+
+			if (!(flg & ((pin & 1) ? CF_FALLING_ONLY : CF_RISING_ONLY))) {
+				t->count++;
+#ifdef N_COUNT_RATE
+				if (flg & CF_RATE)
+					count_rates[pgm_read_byte(&count_rate_idx[t-counts])-1].stamp = now;
+#endif
+#ifdef CONDITIONAL_SEARCH
+				if (flg & CF_ALERTING)
+					t->flags |= CF_IS_ALERT;
+#endif
+			}
+		}
+		d >>= 1;
+		pin >>= 1;
+		cb++;
+	}
+}
+#endif
+
+#ifdef HAVE_COUNT_SAVE
+#ifndef HAVE_TIMER
+#error "Saving counters requires a timer"
+#endif
+#if COUNT_SAVE > 3276
+#error "count_save: at most 3276 seconds"
+#endif
+#if defined(COUNT_SAVE_ADC) && (!defined(N_ADC) || COUNT_SAVE_ADC > N_ADC)
+#error "count_save_adc: no such ADC"
+#endif
+/*
+ * Counters are saved to a ring of EEPROM slots, one after the other, so
+ * that each slot is written only every COUNT_SLOTS saves. A slot holds a
+ * sequence number, the counters, and a CRC. On startup, the valid slot
+ * with the highest sequence number is the latest one; a slot that was
+ * cut short by a reset fails its CRC and is ignored.
+ *
+ * The main loop writes one byte per pass, and only when the EEPROM is
+ * ready, so saving never blocks the CPU.
+ */
+#define CS_LEN (1+N_COUNT*sizeof(count_val_t)+1)
+static uint8_t count_ee[COUNT_SLOTS][CS_LEN] __attribute__((section(".eeprom")));
+static uint8_t cs_buf[CS_LEN]; // being written, or last written
+static uint8_t cs_pos = CS_LEN; // next byte to write
+static uint8_t cs_slot;
+#if COUNT_SAVE
+static timer_t cs_timer;
+#endif
+#ifdef COUNT_SAVE_ADC
+static char cs_armed;
+#endif
+
+static uint8_t cs_crc(const uint8_t *buf)
+{
+	uint8_t crc = 0, i;
+
+	for(i=0;i<CS_LEN-1;i++)
+		crc = _crc_ibutton_update(crc, buf[i]);
+	return crc;
+}
+
+static void cs_snapshot(uint8_t *buf)
+{
+	uint8_t i;
+	count_t *t = counts;
+	uint8_t sreg = SREG;
+
+	cli();
+	for(i=0;i<N_COUNT;i++,t++) {
+		memcpy(buf, (const void *)&t->count, sizeof(count_val_t));
+		buf += sizeof(count_val_t);
+	}
+	SREG = sreg;
+}
+
+/*
+ * Start saving. Unless FORCE is set, skip if nothing has changed.
+ * A forced save during a save restarts the slot that's being written,
+ * with the same sequence number; the previous slot stays valid.
+ */
+static void count_save(char force)
+{
+	uint8_t buf[N_COUNT*sizeof(count_val_t)];
+
+	cs_snapshot(buf);
+	if (!force && (cs_pos < CS_LEN || !memcmp(buf, cs_buf+1, sizeof(buf))))
+		return;
+	memcpy(cs_buf+1, buf, sizeof(buf));
+	if (cs_pos == CS_LEN) {
+		cs_buf[0]++;
+		if (++cs_slot == COUNT_SLOTS)
+			cs_slot = 0;
+	}
+	cs_buf[CS_LEN-1] = cs_crc(cs_buf);
+	cs_pos = 0;
+}
+
+static inline void poll_count_save(void)
+{
+#ifdef COUNT_SAVE_ADC
+	// Supply voltage is dropping: save now
+	uint16_t v;
+	uint8_t sreg = SREG;
+
+	cli();
+	v = adcs[COUNT_SAVE_ADC-1].value;
+	SREG = sreg;
+	if (v > COUNT_SAVE_LEVEL)
+		cs_armed = 1;
+	else if (cs_armed) {
+		cs_armed = 0;
+		count_save(1);
+	}
+#endif
+#if COUNT_SAVE
+	if (timer_done(&cs_timer)) {
+		timer_start(COUNT_SAVE*10, &cs_timer);
+		count_save(0);
+	}
+#endif
+	if (cs_pos < CS_LEN && eeprom_is_ready()) {
+		eeprom_update_byte(&count_ee[cs_slot][cs_pos], cs_buf[cs_pos]);
+		cs_pos++;
+	}
+}
+
+/* Find the most recently saved slot, and restore the counters from it. */
+static inline void init_count_save(void)
+{
+	uint8_t buf[CS_LEN];
+	uint8_t i;
+	count_t *t = counts;
+	const uint8_t *cp = cs_buf+1;
+
+#if COUNT_SAVE
+	timer_reset(&cs_timer);
+	timer_start(COUNT_SAVE*10, &cs_timer);
+#endif
+	cs_slot = COUNT_SLOTS;
+	for(i=0;i<COUNT_SLOTS;i++) {
+		eeprom_read_block(buf, count_ee[i], CS_LEN);
+		if (cs_crc(buf) != buf[CS_LEN-1])
+			continue;
+		// sequence numbers wrap, so compare the difference
+		if (cs_slot < COUNT_SLOTS && (int8_t)(buf[0]-cs_buf[0]) <= 0)
+			continue;
+		memcpy(cs_buf,buf,CS_LEN);
+		cs_slot = i;
+	}
+	if (cs_slot == COUNT_SLOTS) { // nothing saved yet
+		memset(cs_buf,0,CS_LEN);
+		cs_slot = COUNT_SLOTS-1;
+		return;
+	}
+	for(i=0;i<N_COUNT;i++,t++) {
+		memcpy((void *)&t->count, cp, sizeof(count_val_t));
+		cp += sizeof(count_val_t);
+	}
+}
+#endif // HAVE_COUNT_SAVE
+
+/* Count an edge when the port's state, as seen by poll_port(), changes */
+static inline char poll_count_port(count_t *t)
+{
+	uint8_t trigged=0;
+	port_t *p = &ports[t->port-1];
+
+	if(!(p->flags & PFLG_CURRENT) != !(t->flags & CF_IS_ON)) {
+		if (p->flags & PFLG_CURRENT) {
+			t->flags |= CF_IS_ON;
+			trigged = !(t->flags & CF_FLANK_MASK) ||
+				!!(t->flags & CF_RISING_ONLY);
+		}else{
+			t->flags &=~CF_IS_ON;
+			trigged = !(t->flags & CF_FLANK_MASK) ||
+				!!(t->flags & CF_FALLING_ONLY);
+		}
+		if(trigged)
+			t->count++;
+	}
+	return trigged;
+}
+
 static uint8_t poll_next = 0;
 void poll_count(void)
 {
 	uint8_t i = poll_next;
-	uint8_t trigged=0;
+	char trigged;
 	count_t *t;
-	port_t *p;
 
+#ifdef HAVE_COUNT_SAVE
+	poll_count_save();
+#endif
 	if (i >= N_COUNT)
 		i = 0;
 #ifdef CONDITIONAL_SEARCH
@@ -61,26 +415,37 @@ void poll_count(void)
 	i++;
 	poll_next = i;
 
-	p = &ports[t->port-1];
-	if(!(p->flags & PFLG_CURRENT) != !(t->flags & CF_IS_ON)) {
-		if (p->flags & PFLG_CURRENT) {
-			t->flags |= CF_IS_ON;
-			trigged = !(t->flags & CF_FLANK_MASK) ||
-				!!(t->flags & CF_RISING_ONLY);
-		}else{
-			t->flags &=~CF_IS_ON;
-			trigged = !(t->flags & CF_FLANK_MASK) ||
-				!!(t->flags & CF_FALLING_ONLY);
-		}
-		if(trigged) {
-			t->count++;
+#ifdef N_COUNT_RATE
+	uint16_t now = timer_ticks();
+	count_clock += (uint16_t)(now - count_clock_last);
+	count_clock_last = now;
+#endif
+
+#ifdef COUNT_TIMER1
+	if (t->flags & CF_TIMER1)
+		trigged = poll_count_timer1(t);
+	else
+#endif
+#ifdef COUNT_IRQ_BITS
+	if (t->flags & CF_IRQ)
+		trigged = 0; // count_irq() does everything
+	else
+#endif
+		trigged = poll_count_port(t);
 #ifdef CONDITIONAL_SEARCH
-			if(t->flags & CF_ALERTING) {
-				t->flags |= CF_IS_ALERT;
-			}
+	if(trigged && (t->flags & CF_ALERTING))
+		t->flags |= CF_IS_ALERT;
+#endif
+#ifdef N_COUNT_RATE
+	if ((t->flags & CF_RATE) && poll_count_rate(t, now)) {
+#ifdef CONDITIONAL_SEARCH
+		uint8_t sreg = SREG;
+		cli();
+		t->flags |= CF_IS_ALERT;
+		SREG = sreg;
 #endif
-		}
 	}
+#endif
 #ifdef CONDITIONAL_SEARCH
 	if(t->flags & CF_IS_ALERT) {
 		max_seen = i;
@@ -96,6 +461,15 @@ void init_count(void)
 	for(i=0;i<N_COUNT;i++,t++) {
 		t->count = 0;
 	}
+#ifdef HAVE_COUNT_SAVE
+	init_count_save();
+#endif
+#ifdef COUNT_TIMER1
+	init_count_timer1();
+#endif
+#ifdef N_COUNT_RATE
+	init_count_rate();
+#endif
 }
 
 
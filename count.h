@@ -6,6 +6,18 @@
 
 #if defined(N_COUNT)
 
+/* Counter width in bytes, as sent via 1wire */
+#ifndef COUNT_SIZE
+#define COUNT_SIZE 2
+#endif
+#if COUNT_SIZE == 2
+typedef uint16_t count_val_t;
+#elif COUNT_SIZE == 3 || COUNT_SIZE == 4
+typedef uint32_t count_val_t;
+#else
+#error "COUNT_SIZE must be 2, 3 or 4"
+#endif
+
 typedef struct {
 	uint8_t port;
 	unsigned char flags;
@@ -13,14 +25,29 @@ typedef struct {
 #define CF_ALERTING (1<<0)
 #define CF_FALLING_ONLY (1<<1)
 #define CF_RISING_ONLY (1<<2)
+#define CF_TIMER1 (1<<3) // counted by hardware
+#define CF_IRQ (1<<4) // counted by the pin change interrupt
+#define CF_RATE (1<<5) // measure the pulse rate
 #define CF_IS_ALERT (1<<6)
 #define CF_IS_ON (1<<7)
-	uint16_t count;
-#define COUNT_SIZE 2
+	count_val_t count;
 } count_t;
 
 extern count_t counts[];
 
+#ifdef N_COUNT_RATE
+/* Pulse rate, in Hz, with 8 fractional bits. Zero if not measured. */
+uint32_t count_rate(count_t *t);
+/* Alert when the rate leaves LO…HI. Zero: no limit. */
+void count_rate_limits(count_t *t, uint32_t lo, uint32_t hi);
+#endif
+
+#ifdef COUNT_IRQ_BITS
+/* Called from the pin change interrupt: pins D of port bank BANK have
+ * changed at timer_ticks() NOW, PIN is their new state. */
+void count_irq(uint8_t bank, uint8_t d, uint8_t pin, uint16_t now);
+#endif
+
 #ifdef CONDITIONAL_SEARCH
 extern uint8_t count_changed_cache;
 #endif
@@ -54,6 +54,8 @@
 #define ADPIN PINB
 #define ADPIN_vect PCINT0_vect
 #define ADMSK PCMSK
+#define PCMSK0 PCMSK
+#define PCICR GIMSK
 #define PCIF0 PCIF
 #define PCIE0 PCIE
 #endif
@@ -88,6 +90,7 @@
 #define ADPIN PINA
 #define ADPIN_vect PCINT0_vect
 #define ADMSK PCMSK0
+#define PCICR GIMSK
 #endif
 
 #if defined(__AVR_ATmega168__) || defined(__AVR_ATmega88__) || defined (__AVR_ATmega328__)
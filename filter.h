@@ -0,0 +1,69 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+/*
+ *  Copyright © 2014-2015, Matthias Urlichs <matthias@urlichs.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License (included; see the file LICENSE)
+ *  for more details.
+ */
+
+/*
+ * Smoothing filters for input values.
+ *
+ * An exponential filter moves its output 1/2^n of the way towards each
+ * new value. A boxcar filter returns the average of the last 2^n values,
+ * which it keeps in a buffer.
+ *
+ * Both start with the first value they see, so there's no ramp-up.
+ */
+
+#include <stdint.h>
+
+#define FILTER_BOX   0x80 // boxcar filter (else exponential)
+#define FILTER_SHIFT 0x0F
+#define FILTER_START 0xFF // pos: no value yet
+
+typedef struct {
+	uint32_t sum; // exponential: output<<n. Boxcar: sum of buf[]
+	uint8_t pos;  // boxcar: next buf[] entry to replace
+} filter_t;
+
+static inline void filter_init(filter_t *f)
+{
+	f->pos = FILTER_START;
+}
+
+static inline uint16_t filter_step(filter_t *f, uint8_t mode, uint16_t *buf, uint16_t x)
+{
+	uint8_t n = mode & FILTER_SHIFT;
+
+	if (!(mode & FILTER_BOX)) {
+		if (f->pos == FILTER_START) {
+			f->pos = 0;
+			f->sum = (uint32_t)x << n;
+		} else
+			f->sum = f->sum - (f->sum >> n) + x;
+	} else if (f->pos == FILTER_START) {
+		uint8_t i;
+		for (i=0; i < (1<<n); i++)
+			buf[i] = x;
+		f->pos = 0;
+		f->sum = (uint32_t)x << n;
+	} else {
+		f->sum = f->sum - buf[f->pos] + x;
+		buf[f->pos] = x;
+		f->pos = (f->pos+1) & ((1<<n)-1);
+	}
+	return f->sum >> n;
+}
+
+#endif // filter_h
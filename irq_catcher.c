@@ -98,9 +98,11 @@ void __vector_1(void) { ping_me(1); } // INT0
 #if !defined(ONEWIRE_IRQNUM) || ONEWIRE_IRQNUM != -2
 void __vector_2(void) { ping_me(2); }
 #endif
+#ifndef HAVE_PORT_IRQ
 void __vector_3(void) { ping_me(3); }
 void __vector_4(void) { ping_me(4); }
 void __vector_5(void) { ping_me(5); }
+#endif
 void __vector_6(void) { ping_me(6); }
 void __vector_7(void) { ping_me(7); }
 void __vector_8(void) { ping_me(8); }
@@ -111,18 +113,22 @@ void __vector_10(void) { ping_me(10); }
 void __vector_11(void) { ping_me(11); }
 void __vector_12(void) { ping_me(12); }
 void __vector_13(void) { ping_me(13); }
+#ifndef HAVE_TIMER
 void __vector_14(void) { ping_me(14); }
+#endif
+#ifndef N_PWM_FAST
 void __vector_15(void) { ping_me(15); }
-#ifndef HAVE_TIMER
-void __vector_16(void) { ping_me(16); }
 #endif
+void __vector_16(void) { ping_me(16); }
 void __vector_17(void) { ping_me(17); }
 #ifndef HAVE_UART_IRQ
 void __vector_18(void) { ping_me(18); }
 void __vector_19(void) { ping_me(19); }
 #endif
 void __vector_20(void) { ping_me(20); }
+#if !defined(HAVE_ADC_IRQ) || !defined(N_ADC)
 void __vector_21(void) { ping_me(21); }
+#endif
 void __vector_22(void) { ping_me(22); }
 void __vector_23(void) { ping_me(23); }
 void __vector_24(void) { ping_me(24); }
@@ -0,0 +1,69 @@
+/*
+ *  Copyright © 2014-2015, Matthias Urlichs <matthias@urlichs.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License (included; see the file LICENSE)
+ *  for more details.
+ */
+
+/* This code collects main loop statistics: how often the loop runs, how
+ * long the longest iteration took, and how much time each type's poll hook
+ * eats. Everything is counted in one-second windows, so the numbers you
+ * read are a stable snapshot of the last full second.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <string.h>
+
+#include "features.h"
+#include "loopstat.h"
+#include "timer.h"
+
+#ifdef HAVE_LOOPSTAT
+
+uint16_t loopstat_loops;
+uint16_t loopstat_rounds;
+uint16_t loopstat_poll[TC_MAX];
+uint16_t loopstat_max;
+
+uint16_t loopstat_nrounds;
+static uint16_t nloops;
+static uint16_t npoll[TC_MAX];
+static uint16_t last_loop;
+static timer_t window;
+
+void loopstat_polled(uint8_t type, uint16_t start)
+{
+	npoll[type] += timer_ticks() - start;
+}
+
+void loopstat_loop(void)
+{
+	uint16_t now = timer_ticks();
+	uint16_t d = now - last_loop;
+
+	last_loop = now;
+	if (loopstat_max < d)
+		loopstat_max = d;
+	nloops++;
+
+	if (timer_done(&window)) {
+		timer_start(10,&window);
+		loopstat_loops = nloops;
+		loopstat_rounds = loopstat_nrounds;
+		memcpy(loopstat_poll,npoll,sizeof(npoll));
+		nloops = 0;
+		loopstat_nrounds = 0;
+		memset(npoll,0,sizeof(npoll));
+	}
+}
+
+#endif // HAVE_LOOPSTAT
@@ -0,0 +1,71 @@
+#ifndef LOOPSTAT_H
+#define LOOPSTAT_H
+
+/*
+ *  Copyright © 2014-2015, Matthias Urlichs <matthias@urlichs.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License (included; see the file LICENSE)
+ *  for more details.
+ */
+
+#include "dev_data.h"
+#include "features.h"
+#include "timer.h"
+
+#ifdef HAVE_LOOPSTAT
+
+#ifndef HAVE_TIMER
+#error "Main loop statistics need the timer"
+#endif
+#ifndef N_STATUS
+#error "Main loop statistics are reported via 'status'"
+#endif
+#ifdef IS_BOOTLOADER
+#error "Main loop statistics don't work in the boot loader"
+#endif
+
+/* All times are in timer ticks, i.e. units of TIMER_PRESCALE clocks. */
+
+/* Values of the last one-second window */
+extern uint16_t loopstat_loops;  // main loop iterations
+extern uint16_t loopstat_rounds; // moat_poll() rounds, i.e. calls per type
+extern uint16_t loopstat_poll[TC_MAX]; // time spent in poll_* hooks
+
+/* Longest main loop iteration since the last loopstat_clear() */
+extern uint16_t loopstat_max;
+
+/* Call once per main loop iteration */
+void loopstat_loop(void);
+
+/* Call when moat_poll() starts over */
+extern uint16_t loopstat_nrounds;
+static inline void loopstat_round(void) {
+	loopstat_nrounds++;
+}
+
+/* Bracket a poll_* hook */
+static inline uint16_t loopstat_start(void) {
+	return timer_ticks();
+}
+void loopstat_polled(uint8_t type, uint16_t start);
+
+static inline void loopstat_clear(void) {
+	loopstat_max = 0;
+}
+
+#else // !HAVE_LOOPSTAT
+
+#define loopstat_loop() do {} while(0)
+#define loopstat_round() do {} while(0)
+
+#endif // HAVE_LOOPSTAT
+
+#endif // loopstat_h
@@ -30,6 +30,8 @@
 #include "moat.h"
 #include "jmp.h"
 #include "status.h"
+#include "loopstat.h"
+#include "stackcheck.h"
 
 uint8_t mcusr __attribute__ ((section (".noinit")));
 #ifdef HAVE_IRQ_CATCHER
@@ -92,6 +94,7 @@ init_mcu(void)
 static inline void
 init_all(void)
 {
+	stackcheck_init();
 	eeprom_init();
 	console_init();
 	onewire_init();
@@ -151,9 +154,11 @@ main(void)
 #if defined(HAVE_WATCHDOG) && (!defined(ONEWIRE_MOAT) || !defined(CONDITIONAL_SEARCH))
 		wdt_reset();
 #endif
+		stackcheck_poll();
 #ifdef IS_BOOTLOADER
 		onewire_poll();
 #else
+		loopstat_loop();
 		poll_all();
 		mainloop();
 #endif
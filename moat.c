@@ -33,6 +33,7 @@
 #include "console.h"
 #include "timer.h"
 #include "crc.h"
+#include "loopstat.h"
 
 #define _1W_READ_GENERIC  0xF2
 #define _1W_WRITE_GENERIC 0xF4
@@ -190,14 +191,24 @@ void moat_poll(void)
 {
 	static uint8_t i = 0;
 	poll_fn *pf;
+#ifdef HAVE_LOOPSTAT
+	uint16_t start;
+#endif
 
 	if (i >= tc_max) {
 		i = 0;
+		loopstat_round();
 		return;
 		// this makes sure that we do nothing if tc_max==0
 	}
 	pf = pgm_read_ptr(&dispatch[i].poll);
+#ifdef HAVE_LOOPSTAT
+	start = loopstat_start();
+	pf();
+	loopstat_polled(i, start);
+#else
 	pf();
+#endif
 	i++;
 }
 
@@ -255,7 +266,9 @@ void moat_init(void)
    PRR =
 			(1 << PRTWI) // TWI not used at all
         |(1 << PRSPI) // SPI not used at all
-        |(1 << PRTIM1) // Timer 1 not used at all
+#if !defined(HAVE_PWM_TIMER1) && !defined(COUNT_TIMER1)
+        |(1 << PRTIM1) // Timer 1 not used for hardware PWM or counting
+#endif
 			// Timer 2 is used for OW on Mega88
 #ifndef HAVE_TIMER
         |(1 << PRTIM0)
@@ -269,8 +282,10 @@ void moat_init(void)
 		;
 #elif defined(__AVR_ATtiny25__) || defined(__AVR_ATtiny45__) || defined(__AVR_ATtiny85__)\
 	|| defined (__AVR_ATtiny84__)
-	PRR =
-			 (1 << PRTIM1) // Timer 1 not used at all
+	PRR = 0
+#if !defined(HAVE_PWM_TIMER1) && !defined(COUNT_TIMER1)
+			|(1 << PRTIM1) // Timer 1 not used for hardware PWM or counting
+#endif
 			 // Timer 2 is used for OW on these devices
 #ifndef HAVE_UART
 			|(1 << PRUSI)
@@ -307,12 +322,17 @@ void update_idle(uint8_t bits)
 }
 
 #if CONSOLE_PING
-timer_t t;
+static void console_ping(timer_call_t *tc)
+{
+	console_putc('!');
+	timer_call_at(tc, tc->when+CONSOLE_PING);
+}
+static timer_call_t ping = { .fn = console_ping };
 #endif
 void init_state(void)
 {
 #if CONSOLE_PING
-	timer_start(CONSOLE_PING,&t);
+	timer_call_in(&ping, CONSOLE_PING);
 #endif
 	moat_init();
 }
@@ -329,10 +349,4 @@ uint8_t condition_met(void) {
 void mainloop(void) {
 	DBG(0x1E);
 	moat_poll();
-#if CONSOLE_PING
-	if(timer_done(&t)) {
-		console_putc('!');
-		timer_start(CONSOLE_PING,&t);
-	}
-#endif
 }
@@ -37,13 +37,18 @@ uint8_t read_adc_len(uint8_t chan)
 void read_adc(uint8_t chan, uint8_t *buf)
 {
 	adc_t *adcp;
+	uint16_t val;
+	uint8_t sreg = SREG;
 	if (chan) { // one input: send flags, mark as scanned
 		if (chan > N_ADC)
 			next_idle('p');
 		adcp = &adcs[chan-1];
+		cli();
 		*buf++ = adcp->flags;
-		*buf++ = adcp->value>>8;
-		*buf++ = adcp->value&0xFF;
+		val = adcp->value;
+		SREG = sreg;
+		*buf++ = val>>8;
+		*buf++ = val&0xFF;
 		*buf++ = adcp->lower>>8;
 		*buf++ = adcp->lower&0xFF;
 		*buf++ = adcp->upper>>8;
@@ -53,8 +58,11 @@ void read_adc(uint8_t chan, uint8_t *buf)
 		adcp = adcs;
 
 		for(i=0;i<N_ADC;i++) {
-			*buf++ = adcp->value>>8;
-			*buf++ = adcp->value&0xFF;
+			cli();
+			val = adcp->value;
+			SREG = sreg;
+			*buf++ = val>>8;
+			*buf++ = val&0xFF;
 			adcp++;
 		}
 	}
@@ -62,9 +70,12 @@ void read_adc(uint8_t chan, uint8_t *buf)
 
 void read_adc_done(uint8_t chan) {
 	adc_t *adcp;
+	uint8_t sreg = SREG;
 	if(!chan) return;
 	adcp = &adcs[chan-1];
+	cli();
 	adcp->flags &=~ (ADC_IS_ALERT_L|ADC_IS_ALERT_H);
+	SREG = sreg;
 }
 
 void write_adc_check(uint8_t chan, uint8_t *buf, uint8_t len)
@@ -82,6 +93,7 @@ void write_adc(uint8_t chan, uint8_t *buf, uint8_t len)
 	uint8_t x;
 	uint16_t lower,upper;
 	adc_t *adcp = &adcs[chan-1];
+	uint8_t sreg;
 	if (len == 2) {
 		x = *buf++;
 		lower = (x<<8)|x;
@@ -93,9 +105,12 @@ void write_adc(uint8_t chan, uint8_t *buf, uint8_t len)
 		upper = (*buf++)<<8;
 		upper |= *buf++;
 	}
+	sreg = SREG;
+	cli();
 	adcp->lower = lower;
 	adcp->upper = upper;
 	adcp->flags &=~ (ADC_IS_ALERT_L|ADC_IS_ALERT_H);
+	SREG = sreg;
 }
 
 #ifdef CONDITIONAL_SEARCH
@@ -26,14 +26,51 @@
 #include "timer.h"
 
 #ifdef N_COUNT
-#define BLEN N_COUNT*sizeof(t->count)
+#define BLEN (N_COUNT*COUNT_SIZE)
+#if BLEN > MAXBUF
+#error "Too many counters to read at once"
+#endif
+
+/* A snapshot of all counters, taken by writing to channel 0 */
+static count_val_t count_latch[N_COUNT];
+static uint8_t count_latched;
+
+static uint8_t *put_count(uint8_t *buf, count_val_t c)
+{
+#if COUNT_SIZE >= 4
+	*buf++ = c>>24;
+#endif
+#if COUNT_SIZE >= 3
+	*buf++ = c>>16;
+#endif
+	*buf++ = c>>8;
+	*buf++ = c;
+	return buf;
+}
+
+/* Copy all counters at the same time */
+static void count_snapshot(count_val_t *c)
+{
+	uint8_t i;
+	count_t *t = counts;
+	uint8_t sreg = SREG;
+
+	cli();
+	for(i=0;i<N_COUNT;i++,t++)
+		*c++ = t->count;
+	SREG = sreg;
+}
 
 uint8_t read_count_len(uint8_t chan)
 {
-	count_t *t;
-	if(chan)
-		return sizeof(t->count);
-	else
+	if(chan) {
+#ifdef N_COUNT_RATE
+		// followed by the rate
+		if (chan <= N_COUNT && (counts[chan-1].flags & CF_RATE))
+			return COUNT_SIZE+4;
+#endif
+		return COUNT_SIZE;
+	} else
 		return BLEN;
 }
 
@@ -42,42 +79,72 @@ void read_count(uint8_t chan, uint8_t *buf)
 	count_t *t;
 
 	if (chan) { // one COUNT: send value
+		count_val_t c;
+		uint8_t sreg = SREG;
+
 		if (chan > N_COUNT)
 			next_idle('p');
 		t = &counts[chan-1];
 
 		cli();
-#if COUNT_SIZE >= 4
-		*buf++ = t->count>>24;
-#endif
-#if COUNT_SIZE >= 3
-		*buf++ = t->count>>16;
-#endif
-#if COUNT_SIZE >= 2
-		*buf++ = t->count>>8;
-#endif
-		*buf++ = t->count;
+		c = t->count;
 		t->flags &=~ CF_IS_ALERT;
-		sei();
-	} else { // all COUNTs
+		SREG = sreg;
+		buf = put_count(buf, c);
+#ifdef N_COUNT_RATE
+		if (t->flags & CF_RATE) {
+			uint32_t r = count_rate(t);
+			*buf++ = r>>24;
+			*buf++ = r>>16;
+			*buf++ = r>>8;
+			*buf = r;
+		}
+#endif
+	} else { // all COUNTs, latched if requested
 		uint8_t i;
-		t = counts;
 
-		for(i=0;i<N_COUNT;i++,t++) {
-			cli();
-#if COUNT_SIZE >= 4
-			*buf++ = t->count>>24;
-#endif
-#if COUNT_SIZE >= 3
-			*buf++ = t->count>>16;
-#endif
-#if COUNT_SIZE >= 2
-			*buf++ = t->count>>8;
+		if (!count_latched)
+			count_snapshot(count_latch);
+		for(i=0;i<N_COUNT;i++)
+			buf = put_count(buf, count_latch[i]);
+	}
+}
+
+void read_count_done(uint8_t chan)
+{
+	if (!chan)
+		count_latched = 0;
+}
+
+void write_count_check(uint8_t chan, uint8_t *buf, uint8_t len)
+{
+#ifdef N_COUNT_RATE
+	if (chan && chan <= N_COUNT && (counts[chan-1].flags & CF_RATE)) {
+		if (len != 8)
+			next_idle('q');
+		return;
+	}
 #endif
-			*buf++ = t->count;
-			sei();
-		}
+	if (chan || len)
+		next_idle('p');
+}
+
+/*
+ * Writing nothing to channel 0 latches all counters.
+ * Rate counters accept their low and high alert limits.
+ */
+void write_count(uint8_t chan, uint8_t *buf, uint8_t len)
+{
+#ifdef N_COUNT_RATE
+	if (chan) {
+		uint32_t lo = ((uint32_t)buf[0]<<24) | ((uint32_t)buf[1]<<16) | (buf[2]<<8) | buf[3];
+		uint32_t hi = ((uint32_t)buf[4]<<24) | ((uint32_t)buf[5]<<16) | (buf[6]<<8) | buf[7];
+		count_rate_limits(&counts[chan-1], lo, hi);
+		return;
 	}
+#endif
+	count_snapshot(count_latch);
+	count_latched = 1;
 }
 
 #ifdef CONDITIONAL_SEARCH
@@ -26,11 +26,30 @@
 
 #ifdef N_PORT
 
+#ifdef N_PORT_PULSE
+static uint8_t pulses_sent;
+#endif
+#if defined(N_PORT_SEQ) && 3*PORT_SEQ_STEPS > MAXBUF
+#error "port_seq_steps: a sequence doesn't fit in the 1wire buffer"
+#endif
+
 uint8_t read_port_len(uint8_t chan)
 {
-	if(chan)
+	if(chan) {
+#ifdef N_PORT_PULSE
+		// flags, then captured pulses
+		uint8_t n = 0;
+		if (chan <= N_PORT) {
+			n = port_pulse_count(&ports[chan-1]);
+			if (n > (MAXBUF-1)/2)
+				n = (MAXBUF-1)/2;
+		}
+		pulses_sent = n;
+		return 1+2*n;
+#else
 		return 1;
-	else
+#endif
+	} else
 		return (N_PORT+7)>>3;
 }
 
@@ -45,43 +64,61 @@ void read_port(uint8_t chan, uint8_t *buf)
 
 		port_pre_send(portp);
 		buf[0] = flg;
+#ifdef N_PORT_PULSE
+		port_pulse_read(portp, buf+1, pulses_sent);
+#endif
 	} else { // all inputs: send bits
-		uint8_t b=0,i,mask=1;
-		portp = ports;
-
-		for(i=0;i<N_PORT;i++) {
-			if(portp->flags & PFLG_CURRENT)
-				b |= mask;
-			mask <<= 1;
-			if (!mask) { // byte is full
-				*buf++ = b;
-				b=0; mask=1;
-			}
-			portp++;
-		}
-		if (mask != 1) // residue
-			*buf = b;
+		uint8_t snap[PORT_BANKS];
+
+		port_sample(snap);
+		PORT_PACK(buf,snap);
 	}
 }
 
 void read_port_done(uint8_t chan) {
-	if (chan)
+	if (chan) {
 		port_post_send(&ports[chan-1]);
+#ifdef N_PORT_PULSE
+		if (pulses_sent)
+			port_pulse_drop(&ports[chan-1], pulses_sent);
+#endif
+	}
 }
 
 void write_port_check(uint8_t chan, uint8_t *buf, uint8_t len)
 {
-	if (chan == 0 || chan > N_PORT)
+	if (chan > N_PORT)
 		next_idle('p');
-	if (len != 1 && len != 2)
+	if (chan == 0) { // mask bitmap, then value bitmap
+		if (len != 2*((N_PORT+7)>>3))
+			next_idle('q');
+#ifdef N_PORT_SEQ
+	} else if (len > 2) { // (delay, value) steps
+		if (len % 3 || len > 3*PORT_SEQ_STEPS || !port_has_seq(&ports[chan-1]))
+			next_idle('q');
+#endif
+	} else if (len != 1 && len != 2)
 		next_idle('q');
 }
 void write_port(uint8_t chan, uint8_t *buf, uint8_t len)
 {
 	uint8_t a,b;
-	port_t *portp = &ports[chan-1];
+	port_t *portp;
+
+	if (chan == 0) {
+		port_set_many(buf, buf+((N_PORT+7)>>3));
+		return;
+	}
+	portp = &ports[chan-1];
 	_P_VARS(portp)
 
+#ifdef N_PORT_SEQ
+	if (len > 2) {
+		port_seq_start(portp, buf, len/3);
+		return;
+	}
+	port_seq_stop(portp);
+#endif
 	a = *buf++;
 	if(len == 1) // len=1: set value
 		port_set(portp,a);
@@ -29,10 +29,23 @@
 #ifdef N_PWM
 #define BLEN N_PWM*2+(N_PWM+7)/8
 
+static uint16_t pwm_remaining(pwm_t *t)
+{
+#ifdef N_PWM_FAST
+	if (t->flags & PWM_FAST)
+		return pwm_fast_left(t);
+#endif
+	return timer_call_remaining(&t->call);
+}
+
 uint8_t read_pwm_len(uint8_t chan)
 {
 	if(chan)
+#ifdef PWM_STAGGER
+		return 9;
+#else
 		return 7;
+#endif
 	else
 		return BLEN;
 }
@@ -47,7 +60,7 @@ void read_pwm(uint8_t chan, uint8_t *buf)
 			next_idle('p');
 		t = &pwms[chan-1];
 		p = &ports[t->port-1];
-		tm=timer_remaining(&t->timer);
+		tm=pwm_remaining(t);
 
 		*buf++ = p->flags;
 		*buf++ = tm>>8;
@@ -56,6 +69,15 @@ void read_pwm(uint8_t chan, uint8_t *buf)
 		*buf++ = t->t_on;
 		*buf++ = t->t_off>>8;
 		*buf++ = t->t_off;
+#ifdef PWM_STAGGER
+		{
+			uint32_t ph = pwm_phase(t);
+			if (ph > 0xFFFF)
+				ph = 0xFFFF;
+			*buf++ = ph>>8;
+			*buf++ = ph;
+		}
+#endif
 	} else { // all PWMs: send port state, time remaining
 		uint8_t i;
 		t = pwms;
@@ -73,7 +95,7 @@ void read_pwm(uint8_t chan, uint8_t *buf)
 				}
 				*buf++ = v;
 			}
-			tm=timer_remaining(&t->timer);
+			tm=pwm_remaining(t);
 			*buf++ = tm>>8;
 			*buf++ = tm;
 		}
@@ -82,15 +104,30 @@ void read_pwm(uint8_t chan, uint8_t *buf)
 
 void write_pwm_check(uint8_t chan, uint8_t *buf, uint8_t len)
 {
-	if (chan == 0 || chan > N_PWM || (len != 2 && len != 4))
+	if (chan == 0 || chan > N_PWM)
+		next_idle('w');
+#ifdef N_PWM_FAST
+	// no times above PWM_FAST_MAX, i.e. the top bit must be clear
+	if ((pwms[chan-1].flags & PWM_FAST) && len >= 2 &&
+			((buf[0] | buf[(len == 2) ? 1 : 2]) & 0x80))
 		next_idle('w');
+#endif
+	if (len == 2 || len == 4)
+		return;
+#ifdef N_PWM_FADE
+	// on, off, ramp time, optional curve
+	if ((len == 6 || len == 7) && pwm_has_fade(&pwms[chan-1]) &&
+			(buf[4]<<8|buf[5]) <= PWM_FADE_MAX &&
+			(len == 6 || buf[6] <= PWM_CURVE_GAMMA))
+		return;
+#endif
+	next_idle('w');
 }
 void write_pwm(uint8_t chan, uint8_t *buf, uint8_t len)
 {
 	pwm_t *t = &pwms[chan-1];
-	uint16_t a,b,last;
+	uint16_t a,b;
 
-	last = ((t->flags & PWM_IS_ON) ? t->t_on : t->t_off);
 	if (len == 2) {
 		a = buf[0];
 		a |= a<<8;
@@ -100,10 +137,14 @@ void write_pwm(uint8_t chan, uint8_t *buf, uint8_t len)
 		a = buf[0]<<8|buf[1];
 		b = buf[2]<<8|buf[3];
 	}
-	t->t_on = a;
-	t->t_off = b;
-	if(!last || (t->flags & PWM_FORCE))
-		timer_reset(&t->timer);
+#ifdef N_PWM_FADE
+	if (len > 4) {
+		pwm_fade_start(t, a, b, buf[4]<<8|buf[5], (len > 6) ? buf[6] : PWM_CURVE_LINEAR);
+		return;
+	}
+	pwm_fade_stop(t);
+#endif
+	pwm_set(t, a, b, t->flags & PWM_FORCE);
 }
 
 #ifdef CONDITIONAL_SEARCH
@@ -24,10 +24,16 @@
 #include "onewire.h"
 #include "status.h"
 #include "timer.h"
+#include "loopstat.h"
+#include "stackcheck.h"
 #include "_status.h"
 
 #ifdef N_STATUS
 
+#if defined(HAVE_LOOPSTAT) && 7+2*TC_MAX > MAXBUF
+#error "Too many types for the main loop statistics"
+#endif
+
 #if N_STATUS>1 && defined(IS_BOOTLOADER)
 static const char buildv[] __attribute__ ((progmem)) = BUILDVER;
 #endif
@@ -42,6 +48,18 @@ uint8_t read_status_len(uint8_t chan)
 #if N_STATUS>1 && defined(IS_BOOTLOADER)
 	case S_loader:
 		return strlen(BUILDVER);
+#endif
+#ifdef HAVE_LOOPSTAT
+	case S_loop:
+		return 7+2*TC_MAX;
+#endif
+#ifdef HAVE_STACKCHECK
+	case S_stack:
+		return 4;
+#endif
+#ifdef ONEWIRE_STUCK_CHECK
+	case S_bus:
+		return 4;
 #endif
 	default:
 		next_idle('s');
@@ -56,6 +74,15 @@ void read_status(uint8_t chan, uint8_t *buf)
 		*buf = ((1<<(STATUS_MAX-1))-1)
 #if N_STATUS < 2 || !defined(IS_BOOTLOADER)
 			& ~(1<<(S_loader-1))
+#endif
+#ifndef HAVE_LOOPSTAT
+			& ~(1<<(S_loop-1))
+#endif
+#ifndef HAVE_STACKCHECK
+			& ~(1<<(S_stack-1))
+#endif
+#ifndef ONEWIRE_STUCK_CHECK
+			& ~(1<<(S_bus-1))
 #endif
 		;
 		break;
@@ -73,12 +100,74 @@ void read_status(uint8_t chan, uint8_t *buf)
 			v++;
 		}
 		break;
+#endif
+#ifdef HAVE_LOOPSTAT
+	case S_loop: {
+		/* Main loop statistics, all times in ticks:
+		 *  1 log2(clocks per tick)
+		 *  2 main loop iterations during the last second
+		 *  2 longest main loop iteration since the last read
+		 *  2 moat_poll() rounds during the last second
+		 *  2*TC_MAX time spent in each type's poll hook during the last second
+		 */
+		uint8_t i;
+		uint16_t v;
+
+		*buf++ = TIMER_PRESCALE_LOG2;
+		*buf++ = loopstat_loops>>8;
+		*buf++ = loopstat_loops;
+		*buf++ = loopstat_max>>8;
+		*buf++ = loopstat_max;
+		*buf++ = loopstat_rounds>>8;
+		*buf++ = loopstat_rounds;
+		for(i=0;i<TC_MAX;i++) {
+			v = loopstat_poll[i];
+			*buf++ = v>>8;
+			*buf++ = v;
+		}
+		break;
+		}
+#endif
+#ifdef HAVE_STACKCHECK
+	case S_stack: {
+		/* Free RAM:
+		 *  2 bytes never touched by the stack, i.e. the high-water mark
+		 *  2 bytes available for the stack, i.e. RAM size minus static data
+		 */
+		uint16_t v = stack_free();
+		*buf++ = v>>8;
+		*buf++ = v;
+		v = stack_size();
+		*buf++ = v>>8;
+		*buf++ = v;
+		break;
+		}
+#endif
+#ifdef ONEWIRE_STUCK_CHECK
+	case S_bus:
+		/* 1wire bus recovery:
+		 *  2 transactions aborted because the master went away
+		 *  2 times the line was held low for too long
+		 */
+		*buf++ = onewire_timeouts>>8;
+		*buf++ = onewire_timeouts;
+		*buf++ = onewire_stuck_low>>8;
+		*buf++ = onewire_stuck_low;
+		break;
 #endif
 	default:
 		next_idle('s');
 	}
 }
 
+void read_status_done(uint8_t chan)
+{
+#ifdef HAVE_LOOPSTAT
+	if (chan == S_loop)
+		loopstat_clear();
+#endif
+}
+
 #ifdef CONDITIONAL_SEARCH
 
 char alert_status_check(void)
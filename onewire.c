@@ -21,13 +21,62 @@
 
 ow_addr_t ow_addr;
 
+#ifndef ONEWIRE_FAST
 volatile uint8_t bitp;  // mask of current bit
+#endif
 volatile uint8_t bytep; // position of current byte
 volatile uint8_t cbuf;  // char buffer, current byte to be (dis)assembled
 volatile xmode_t xmode;
+#ifndef ONEWIRE_FAST
 volatile wmode_t wmode;
+#endif
 volatile uint8_t actbit; // current bit. Keeping this saves 14bytes ROM
 
+#ifdef ONEWIRE_STUCK_CHECK
+volatile uint8_t ow_slots;
+uint16_t onewire_timeouts;
+uint16_t onewire_stuck_low;
+static uint8_t ow_watching;
+static uint8_t ow_last_slots;
+static uint16_t ow_last_seen;
+
+/*
+ * Called from every loop which waits for the bus. If no edge has been seen
+ * for ONEWIRE_TIMEOUT msec, the master has given up on us in the middle of
+ * a transaction; if the line has been low for longer than any reset pulse,
+ * something is shorting the bus. Either way, go back to sleep instead of
+ * waiting for the watchdog.
+ */
+static void check_stuck(void)
+{
+	uint16_t now = timer_ticks();
+	uint8_t slots = ow_slots;
+
+	if (!ow_watching || slots != ow_last_slots) {
+		ow_watching = 1;
+		ow_last_slots = slots;
+		ow_last_seen = now;
+		return;
+	}
+	if (mode == OWM_IN_RESET) {
+		if (now - ow_last_seen < OWT_STUCK_LOW)
+			return;
+		onewire_stuck_low++;
+		DBG_C('L');
+	} else {
+		if (now - ow_last_seen < OWT_TIMEOUT)
+			return;
+		onewire_timeouts++;
+		DBG_C('T');
+	}
+	ow_watching = 0;
+	set_idle();
+	go_out();
+}
+#else
+#define check_stuck() do {} while(0)
+#endif
+
 void
 onewire_init(void)
 {
@@ -112,6 +161,7 @@ void _wait_complete(void)
 			//DBG_OFF();
 			return;
 		}
+		check_stuck();
 		uart_poll();
 		update_idle((mode == OWM_IDLE || bitp < 0x80) ? 8 : 1);
 	}
@@ -348,8 +398,12 @@ char _onewire_poll(void) {
 	}
 	if (mode == OWM_SLEEP) {
 		DBG(0x2F);
+#ifdef ONEWIRE_STUCK_CHECK
+		ow_watching = 0;
+#endif
 		return 0;
 	}
+	check_stuck();
 
 	// RESET processing takes longer.
 	update_idle((mode == OWM_SLEEP) ? 100
@@ -400,6 +454,162 @@ void set_idle(void)
 	SREG = sreg;
 }
 
+#ifdef ONEWIRE_FAST
+// Bit-level states, in assembly. Everything else, as well as errors and
+// the end of a search byte, is handled by real_TIMER_INT.
+// Only r24, r25 and SREG are saved, instead of the C handler's full set.
+void real_TIMER_INT(void) __attribute__((signal));
+void TIMER_VECT(void) __attribute__((naked));
+void TIMER_VECT(void)
+{
+	// Only r24, r25 and the T flag may be used before jumping to the C code.
+	asm volatile(
+	"     push r24\n"
+	"     in r24,__SREG__\n"
+	"     push r24\n"
+	"     push r25\n"
+	// Read input line state first
+	"     clt\n"
+	"     sbic %[pin],%[pbit]\n"
+	"     set\n"
+	// pin interrupt still on: reset pulse, let the C code handle it
+	"     lds r24,%[imsk]\n"
+	"     sbrc r24,%[intbit]\n"
+	"     rjmp .Lt_slow\n"
+	"     in r24,%[r_mode]\n"
+	"     cpi r24,%[m_read]\n"
+	"     breq .Lt_read\n"
+	"     cpi r24,%[m_write]\n"
+	"     breq .Lt_write\n"
+	"     cpi r24,%[m_sread]\n"
+	"     breq .Lt_sread\n"
+	"     cpi r24,%[m_szero]\n"
+	"     breq .Lt_szero\n"
+	"     cpi r24,%[m_sone]\n"
+	"     breq .Lt_sone\n"
+
+	// everything else: restore, continue in C
+".Lt_slow:\n"
+	"     pop r25\n"
+	"     pop r24\n"
+	"     out __SREG__,r24\n"
+	"     pop r24\n"
+	"     rjmp real_TIMER_INT\n"
+
+	// OWM_READ: set bit if line high
+".Lt_read:\n"
+	"     in r25,%[r_bitp]\n"
+	"     tst r25\n"
+	"     breq .Lt_slow\n" // overrun
+	"     brtc 1f\n"
+	"     lds r24,cbuf\n"
+	"     or r24,r25\n"
+	"     sts cbuf,r24\n"
+"1:    lsl r25\n"
+	"     out %[r_bitp],r25\n"
+	"     rjmp .Lt_rearm\n"
+
+	// OWM_WRITE
+".Lt_write:\n"
+	"     cbi %[ddr],%[pbit]\n"
+	"     in r25,%[r_bitp]\n"
+	"     tst r25\n"
+	"     breq 2f\n"
+	"     lds r24,cbuf\n"
+	"     and r24,r25\n"
+	"     breq 1f\n" // zero is OWW_WRITE_0
+	"     ldi r24,%[w_one]\n"
+"1:    out %[r_wmode],r24\n"
+	"     lsl r25\n"
+	"     out %[r_bitp],r25\n"
+	"     rjmp .Lt_rearm\n"
+"2:    ldi r24,%[m_idle]\n"
+	"     out %[r_mode],r24\n"
+	"     ldi r24,%[w_none]\n"
+	"     out %[r_wmode],r24\n"
+	"     rjmp .Lt_rearm\n"
+
+	// OWM_SEARCH_ZERO: next, send the complement of actbit
+".Lt_szero:\n"
+	"     cbi %[ddr],%[pbit]\n"
+	"     ldi r24,%[m_sone]\n"
+	"     out %[r_mode],r24\n"
+	"     lds r24,actbit\n"
+	"     ldi r25,1\n"
+	"     eor r24,r25\n"
+	"     out %[r_wmode],r24\n"
+	"     rjmp .Lt_rearm\n"
+
+	// OWM_SEARCH_ONE
+".Lt_sone:\n"
+	"     cbi %[ddr],%[pbit]\n"
+	"     ldi r24,%[m_sread]\n"
+	"     out %[r_mode],r24\n"
+	"     rjmp .Lt_rearm\n"
+
+	// OWM_SEARCH_READ: the master's bit must match ours
+".Lt_sread:\n"
+	"     lds r24,actbit\n"
+	"     clr r25\n"
+	"     bld r25,0\n"
+	"     cp r24,r25\n"
+	"     brne .Lt_slow\n" // no match
+	"     in r25,%[r_bitp]\n"
+	"     lsl r25\n"
+	"     breq .Lt_slow\n" // next byte
+	"     out %[r_bitp],r25\n"
+	"     ldi r24,%[m_szero]\n"
+	"     out %[r_mode],r24\n"
+	"     lds r24,cbuf\n"
+	"     and r24,r25\n"
+	"     breq 1f\n"
+	"     ldi r24,1\n"
+"1:    sts actbit,r24\n"
+	"     out %[r_wmode],r24\n" // OWW_WRITE_0/1
+	// fall thru
+
+	// SET_TIMER(OWT_MIN_RESET-OWT_READLINE); EN_OWINT();
+".Lt_rearm:\n"
+	"     ldi r24,%[psr]\n"
+	"     sts %[gtccr],r24\n"
+	"     ldi r24,%[count]\n"
+	"     sts %[tcnt],r24\n"
+	"     lds r24,%[imsk]\n"
+	"     ori r24,1<<%[intbit]\n"
+	"     sts %[imsk],r24\n"
+	"     ldi r24,1<<%[ifbit]\n"
+	"     sts %[ifr],r24\n"
+	"     pop r25\n"
+	"     pop r24\n"
+	"     out __SREG__,r24\n"
+	"     pop r24\n"
+	"     reti\n"
+	:: [pin] "I"(_SFR_IO_ADDR(ONEWIRE_PIN)),
+	   [ddr] "I"(_SFR_IO_ADDR(ONEWIRE_DDR)),
+	   [pbit] "I"(ONEWIRE_BIT),
+	   [imsk] "n"(_SFR_MEM_ADDR(IMSK)),
+	   [ifr] "n"(_SFR_MEM_ADDR(IFR)),
+	   [intbit] "I"(OW_INTBIT),
+	   [ifbit] "I"(OW_IFBIT),
+	   [gtccr] "n"(_SFR_MEM_ADDR(GTCCR)),
+	   [tcnt] "n"(_SFR_MEM_ADDR(OW_TCNT)),
+	   [psr] "M"(OW_PSR),
+	   [count] "M"((uint8_t)~(OWT_MIN_RESET-OWT_READLINE)),
+	   [r_mode] "I"(_SFR_IO_ADDR(GPIOR1)),
+	   [r_wmode] "I"(_SFR_IO_ADDR(GPIOR0)),
+	   [r_bitp] "I"(_SFR_IO_ADDR(GPIOR2)),
+	   [m_read] "M"(OWM_READ),
+	   [m_write] "M"(OWM_WRITE),
+	   [m_idle] "M"(OWM_IDLE),
+	   [m_szero] "M"(OWM_SEARCH_ZERO),
+	   [m_sone] "M"(OWM_SEARCH_ONE),
+	   [m_sread] "M"(OWM_SEARCH_READ),
+	   [w_one] "M"(OWW_WRITE_1),
+	   [w_none] "M"(OWW_NO_WRITE)
+	);
+}
+#endif
+
 TIMER_INT
 {
 	//Read input line state first
@@ -534,7 +744,11 @@ void PIN_INT(void)
 	DBG_ON();
 	asm("     push r24");
 	asm("     push r25");
+#ifdef ONEWIRE_FAST
+	asm("     in r24,%0" :: "I"(_SFR_IO_ADDR(GPIOR0)));
+#else
 	asm("     lds r24,wmode");
+#endif
 #ifdef DBGPORT
 	asm("     out %0,r24" :: "i"(((int)&DBGPORT)-__SFR_OFFSET));
 #endif
@@ -553,6 +767,9 @@ void PIN_INT(void)
 #warning "Ignore the 'appears to be a misspelled signal handler' warning"
 void real_PIN_INT(void) {
 	DIS_OWINT(); //disable interrupt, only in OWM_SLEEP mode it is active
+#ifdef ONEWIRE_STUCK_CHECK
+	ow_slots++;
+#endif
 #if 0 // def DBGPIN // modes are volatile
 	if (mode > OWM_PRESENCE) {
 		DBG_ON();
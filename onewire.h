@@ -72,6 +72,14 @@ void onewire_init(void);
 /* Poll the bus. Will not return while a transaction is in progress. */
 void onewire_poll(void);
 
+#if defined(ONEWIRE_TIMEOUT) && defined(HAVE_TIMER)
+#define ONEWIRE_STUCK_CHECK
+/* Number of times the bus has been forced back to idle because the
+   master stopped in mid-transaction, or held the line low for too long */
+extern uint16_t onewire_timeouts;
+extern uint16_t onewire_stuck_low;
+#endif
+
 #else /* !HAVE_ONEWIRE */
 #define onewire_init() do {} while(0)
 #define onewire_poll() do {} while(0)
@@ -36,7 +36,18 @@ typedef union {
 } ow_addr_t;
 extern ow_addr_t ow_addr;
 
+#ifdef ONEWIRE_FAST
+#ifndef GPIOR2
+#error "onewire_fast needs the GPIORx registers"
+#endif
+// The timer interrupt's fast path is written in assembly. It keeps the
+// bit-level state in I/O registers, which are faster to access.
+#define wmode (*(volatile wmode_t *)&GPIOR0)
+#define mode (*(volatile mode_t *)&GPIOR1)
+#define bitp GPIOR2
+#else
 extern volatile uint8_t bitp;  // mask of current bit
+#endif
 extern volatile uint8_t bytep; // position of current byte
 extern volatile uint8_t cbuf;  // char buffer, current byte to be (dis)assembled
 
@@ -72,6 +83,17 @@ extern volatile uint8_t cbuf;  // char buffer, current byte to be (dis)assembled
 #define OWT_READLINE (T_(30)-2)
 #define OWT_LOWTIME (T_(40)-2)
 
+#ifdef ONEWIRE_STUCK_CHECK
+#include "timer.h"
+// These are in timer_ticks() units, not 1wire timer units
+#define OWT_TIMEOUT ((uint16_t)((uint32_t)ONEWIRE_TIMEOUT*F_CPU/TIMER_PRESCALE/1000))
+#define OWT_STUCK_LOW ((uint16_t)(F_CPU/TIMER_PRESCALE/500)) // 2 msec, twice the longest valid reset
+#if (ONEWIRE_TIMEOUT*(F_CPU/TIMER_PRESCALE)/1000 > 30000)
+#error onewire_timeout is too long
+#endif
+extern volatile uint8_t ow_slots; // incremented on every bus edge
+#endif
+
 #if (OWT_MIN_RESET>240)
 #error Reset timing is broken, your clock is too fast
 #endif
@@ -86,6 +108,8 @@ extern volatile uint8_t cbuf;  // char buffer, current byte to be (dis)assembled
 #define SET_FALLING() do {EICRA|=(1<<ISC01);EICRA&=~(1<<ISC00);} while(0) //set interrupt at falling edge
 #define CHK_INT_EN() (IMSK&(1<<INT0)) //test if pin interrupt enabled
 #define PIN_INT INT0_vect  // the interrupt service routine
+#define OW_INTBIT INT0
+#define OW_IFBIT INTF0
 #elif ONEWIRE_IRQNUM == -2
 #define EN_OWINT() do {IMSK|=(1<<INT1);IFR|=(1<<INTF1);}while(0)  //enable interrupt 
 #define DIS_OWINT() do {IMSK&=~(1<<INT1);} while(0)  //disable interrupt
@@ -93,6 +117,8 @@ extern volatile uint8_t cbuf;  // char buffer, current byte to be (dis)assembled
 #define SET_FALLING() do {EICRA|=(1<<ISC11);EICRA&=~(1<<ISC10);} while(0) //set interrupt at falling edge
 #define CHK_INT_EN() (IMSK&(1<<INT1)) //test if pin interrupt enabled
 #define PIN_INT INT1_vect  // the interrupt service routine
+#define OW_INTBIT INT1
+#define OW_IFBIT INTF1
 #else
 #error generic pin change interrupts are not yet supported
 #endif
@@ -103,7 +129,9 @@ extern volatile uint8_t cbuf;  // char buffer, current byte to be (dis)assembled
 #define EN_TIMER() do {TIMSK2 |= (1<<TOIE2); TIFR2|=(1<<TOV2);}while(0) //enable timer interrupt
 #define DIS_TIMER() do {TIMSK2 &= ~(1<<TOIE2);} while(0) // disable timer interrupt
 #define SET_TIMER(x) do { GTCCR = (1<<PSRASY); TCNT2=(uint8_t)~(x); } while(0) // reset prescaler
-#define TIMER_INT ISR(TIMER2_OVF_vect) //the timer interrupt service routine
+#define TIMER_VECT TIMER2_OVF_vect
+#define OW_TCNT TCNT2
+#define OW_PSR (1<<PSRASY)
 
 #else
 #ifdef __AVR_ATmega8__
@@ -118,7 +146,16 @@ extern volatile uint8_t cbuf;  // char buffer, current byte to be (dis)assembled
 #define EN_TIMER() do {TIMSK0 |= (1<<TOIE0); TIFR0|=(1<<TOV0);}while(0) //enable timer interrupt
 #define DIS_TIMER() do {TIMSK0 &= ~(1<<TOIE0);} while(0) // disable timer interrupt
 #define SET_TIMER(x) do { GTCCR = (1<<PSRSYNC); TCNT0=(uint8_t)~(x); } while(0) // reset prescaler
-#define TIMER_INT ISR(TIMER0_OVF_vect) //the timer interrupt service routine
+#define TIMER_VECT TIMER0_OVF_vect
+#define OW_TCNT TCNT0
+#define OW_PSR (1<<PSRSYNC)
+#endif
+
+#ifdef ONEWIRE_FAST
+// TIMER_VECT is in assembly and jumps here for the complicated cases
+#define TIMER_INT void real_TIMER_INT(void)
+#else
+#define TIMER_INT ISR(TIMER_VECT) //the timer interrupt service routine
 #endif
 
 // stupidity
@@ -146,7 +183,9 @@ typedef enum {
 	OWM_READ, // reading some bits
 	OWM_WRITE, // writing some bits
 } mode_t;
+#ifndef ONEWIRE_FAST
 volatile mode_t mode; //state
+#endif
 
 //next high-level state
 typedef enum {
@@ -160,11 +199,13 @@ extern volatile xmode_t xmode;
 // Write this bit at next falling edge from master.
 // We use a whole byte for this for assembly speed reasons.
 typedef enum {
-	OWW_WRITE_0, // used in assembly
-	OWW_WRITE_1,
+	OWW_WRITE_0, // used in assembly, must be zero
+	OWW_WRITE_1, // must be one
 	OWW_NO_WRITE,
 } wmode_t;
+#ifndef ONEWIRE_FAST
 extern volatile wmode_t wmode;
+#endif
 extern volatile uint8_t actbit; // current bit. Keeping this saves 14bytes ROM
 
 static inline void start_reading(uint8_t bits) {
@@ -27,36 +27,83 @@
 #include "dev_data.h"
 #include "debug.h"
 #include "moat_internal.h"
+#include "timer.h"
+#include "count.h"
 
 #ifdef N_PORT
 
+#ifdef CONDITIONAL_SEARCH
+static uint8_t poll_next = 0;
+uint8_t port_changed_cache;
+static uint8_t max_seen = 0;
+#endif
+
 port_t ports[] = {
-#include "_port.h"
+	PORT_DEFS
 };
 
-void port_set(port_t *portp, char val)
+/* Return the state which sets a port in state S to VAL, according to its mode */
+static port_out_t port_want(uint8_t flg, port_out_t s, char val)
 {
 	/* We could pack each switch{} into a single 8-bit value */
-	uint8_t flg = portp->flags;
-	port_out_t s = port_get_out(portp);
 
 	// Rather than write a complicated switch statement, we go by bits.
 	if(flg & PFLG_ALT) {
 		// This does PO_OFF=0 | PO_PULLUP=3 and PO_ON=1 | PO_Z=2
 		// OFF/ON must be 0/1, so test bit 0
-		if((s & 1) != !val) return;
+		if((s & 1) != !val) return s;
 		s ^= 3;
 	} else if(flg & PFLG_ALT2) {
 		// This does PO_OFF=0 | PO_Z=2 and PO_ON=1 | PO_PULLUP=3
 		// OFF/ON must be 0/1, so bit 1 is tested+switched while bit 0 inverts the test if it's set
-		if ((1&((s>>1) ^ s)) != !val) return;
+		if ((1&((s>>1) ^ s)) != !val) return s;
 		s ^= 2;
 	} else {
 		// This does PO_OFF=0 | PO_ON=1 and PO_Z=2 | PO_PULLUP=3
-		if((s & 1) != !val) return;
+		if((s & 1) != !val) return s;
 		s ^= 1;
 	}
-	port_set_out(portp,s);
+	return s;
+}
+
+/*
+ * Levels commanded by interrupt code, by bank: a bit in port_cmd says that
+ * the port's bit in port_cmd_on is its new expected state. The main loop
+ * owns the ports' flags, so poll_port() copies these to PFLG_CURRENT
+ * before it looks for changes.
+ */
+static volatile uint8_t port_cmd[PORT_BANKS], port_cmd_on[PORT_BANKS];
+
+/* Set a port's registers from interrupt code; the next poll updates its
+ * flags. */
+void port_set_pin(port_t *portp, char val)
+{
+	port_out_t s = port_get_out(portp);
+	port_out_t ns = port_want(portp->flags, s, val);
+	uint8_t b = PORT_BANK_IDX(portp->adr>>3);
+	uint8_t m = 1<<(portp->adr & 0x07);
+	uint8_t sreg = SREG;
+
+	cli();
+	if (ns != s)
+		port_set_reg(portp, ns);
+	port_cmd[b] |= m;
+	if (val)
+		port_cmd_on[b] |= m;
+	else
+		port_cmd_on[b] &=~ m;
+	SREG = sreg;
+}
+
+void port_set(port_t *portp, char val)
+{
+	uint8_t flg = portp->flags;
+	port_out_t s = port_get_out(portp);
+	port_out_t ns = port_want(flg, s, val);
+
+	if (ns == s)
+		return;
+	port_set_out(portp,ns);
 
 	// Set "current" to the expected state which we just set.
 	// The next poll will notice if that doesn't match the actual port.
@@ -67,6 +114,196 @@ void port_set(port_t *portp, char val)
 	portp->flags = flg;
 }
 
+/*
+ * Set all ports whose bit in MASK is set to the corresponding bit in VAL.
+ * The new state is calculated for all of them first; then each bank's PORT
+ * and DDR registers are written once, so that all outputs switch together.
+ */
+void port_set_many(const uint8_t *mask, const uint8_t *val)
+{
+	uint8_t pv[PORT_BANKS], dv[PORT_BANKS], chg[PORT_BANKS];
+	uint8_t i, m = 1;
+	port_t *pp = ports;
+	uint8_t sreg;
+
+#ifdef N_PORT_SEQ
+	// Stop these ports' sequences before looking at their state
+	for(i=0;i<N_PORT;i++,pp++)
+		if (mask[i>>3] & (1<<(i&7)))
+			port_seq_stop(pp);
+	pp = ports;
+#endif
+#define _GET_BANK(_n) do { \
+		pv[_n] = PORT_BANK##_n##_PORT; \
+		dv[_n] = PORT_BANK##_n##_DDR; \
+	} while(0)
+#define _SET_BANK(_n) do { \
+		if (chg[_n]) { \
+			PORT_BANK##_n##_PORT = (PORT_BANK##_n##_PORT & ~chg[_n]) | (pv[_n] & chg[_n]); \
+			PORT_BANK##_n##_DDR = (PORT_BANK##_n##_DDR & ~chg[_n]) | (dv[_n] & chg[_n]); \
+		} \
+	} while(0)
+#ifdef PORT_BANK0_PIN
+	_GET_BANK(0);
+#endif
+#ifdef PORT_BANK1_PIN
+	_GET_BANK(1);
+#endif
+#ifdef PORT_BANK2_PIN
+	_GET_BANK(2);
+#endif
+#ifdef PORT_BANK3_PIN
+	_GET_BANK(3);
+#endif
+	memset(chg,0,sizeof(chg));
+
+	for(i=0;i<N_PORT;i++,pp++) {
+		uint8_t b = PORT_BANK_IDX(pp->adr>>3);
+		uint8_t bit = 1<<(pp->adr & 0x07);
+		char v = *val & m;
+		port_out_t s,ns;
+
+		if (*mask & m) {
+			s = (pv[b] & bit) ? PO_ON : PO_OFF;
+			if (!(dv[b] & bit))
+				s |= PO_Z;
+			ns = port_want(pp->flags, s, v);
+			if (ns != s) {
+				pv[b] = (ns & 1) ? (pv[b] | bit) : (pv[b] & ~bit);
+				dv[b] = (ns & 2) ? (dv[b] & ~bit) : (dv[b] | bit);
+				chg[b] |= bit;
+				// see port_set()
+				if (v)
+					pp->flags |= PFLG_CURRENT;
+				else
+					pp->flags &=~PFLG_CURRENT;
+			}
+		}
+		m <<= 1;
+		if (!m) {
+			m = 1;
+			mask++;
+			val++;
+		}
+	}
+
+	// The 1wire code changes its pin's DDR from its interrupt handler.
+	sreg = SREG;
+	cli();
+#ifdef PORT_BANK0_PIN
+	_SET_BANK(0);
+#endif
+#ifdef PORT_BANK1_PIN
+	_SET_BANK(1);
+#endif
+#ifdef PORT_BANK2_PIN
+	_SET_BANK(2);
+#endif
+#ifdef PORT_BANK3_PIN
+	_SET_BANK(3);
+#endif
+	for(i=0;i<PORT_BANKS;i++)
+		port_stale[i] |= chg[i];
+	SREG = sreg;
+#undef _GET_BANK
+#undef _SET_BANK
+}
+
+#ifdef N_PORT_SEQ
+/*
+ * Output sequences run from the timer interrupt, so their timing does not
+ * depend on the main loop. Delays are counted in timer overflows.
+ *
+ * The interrupt only touches the I/O registers; port_set_pin() leaves the
+ * new state for poll_port() to copy to the port's flags.
+ */
+typedef struct {
+	uint16_t left; // timer overflows until the next step; 0: idle
+	uint8_t pos, len; // next step, number of steps
+	struct {
+		uint16_t n; // timer overflows
+		uint8_t val;
+	} step[PORT_SEQ_STEPS];
+} port_seq_t;
+static const uint8_t port_seq_idx[] __attribute__ ((progmem)) = { PORT_SEQ_IDX };
+static const uint8_t port_seq_port[] __attribute__ ((progmem)) = { PORT_SEQ_PORTS };
+static port_seq_t port_seqs[N_PORT_SEQ];
+
+static port_seq_t *port_seq(port_t *portp)
+{
+	uint8_t c = pgm_read_byte(&port_seq_idx[portp-ports]);
+	return c ? &port_seqs[c-1] : NULL;
+}
+
+char port_has_seq(port_t *portp)
+{
+	return port_seq(portp) != NULL;
+}
+
+/* Start a sequence of N (delay msec, value) steps, three bytes each. */
+void port_seq_start(port_t *portp, const uint8_t *steps, uint8_t n)
+{
+	port_seq_t *sq = port_seq(portp);
+	uint8_t i, sreg;
+
+	port_seq_stop(portp);
+	for(i=0;i<n;i++) {
+		uint16_t ms = ((uint16_t)steps[0]<<8) | steps[1];
+		// Round up. t*(F_CPU/TIMER_PRESCALE) may not fit in 32 bits,
+		// so convert whole seconds first and carry the remainder.
+		uint32_t s = (uint32_t)(ms/1000) * (F_CPU/TIMER_PRESCALE);
+		uint32_t t = s / TIMER_CLOCKS;
+		t += ((s % TIMER_CLOCKS)*1000L + (uint32_t)(ms%1000)*(F_CPU/TIMER_PRESCALE)
+			+ 1000L*TIMER_CLOCKS-1) / (1000L*TIMER_CLOCKS);
+		if (t > 0xFFFF)
+			t = 0xFFFF;
+		else if (!t)
+			t = 1;
+		sq->step[i].n = t;
+		sq->step[i].val = steps[2];
+		steps += 3;
+	}
+	sq->pos = 0;
+	sq->len = n;
+	sreg = SREG;
+	cli();
+	sq->left = sq->step[0].n;
+	SREG = sreg;
+}
+
+void port_seq_stop(port_t *portp)
+{
+	port_seq_t *sq = port_seq(portp);
+
+	if (sq) {
+		uint8_t sreg = SREG;
+		cli();
+		sq->left = 0;
+		SREG = sreg;
+	}
+}
+
+void port_seq_timer(void)
+{
+	uint8_t i;
+	port_seq_t *sq = port_seqs;
+
+	for(i=0;i<N_PORT_SEQ;i++,sq++) {
+		port_t *pp;
+		uint8_t val;
+
+		if (!sq->left || --sq->left)
+			continue;
+		pp = &ports[pgm_read_byte(&port_seq_port[i])];
+		val = !!sq->step[sq->pos].val;
+		port_set_pin(pp, val);
+		if (++sq->pos < sq->len)
+			sq->left = sq->step[sq->pos].n;
+	}
+}
+
+#endif // N_PORT_SEQ
+
 /*
  * The idea is to clear the POLL flag if the port has not changed since
  * reporting started. Otherwise, check again.
@@ -75,44 +312,403 @@ void port_set(port_t *portp, char val)
  * CHANGED set.
  */
 
-void port_check(port_t *pp) {
-	_P_VARS(pp)
-	char s = _P_GET(pin);
-	if (s != !!(flg & PFLG_CURRENT)) {
-		// DBG_C('P');DBG_N(pp-ports);DBG_C('=');DBG_N(s); DBG_C(' ');
-		if(s)
-			flg |= PFLG_CURRENT;
-		else
-			flg &=~PFLG_CURRENT;
-		pp->flags = flg | PFLG_CHANGED;
+/*
+ * Port state is sampled one bank (PINB, PINC, …) at a time. The shadow
+ * holds each bank's state as of the last poll, or the last pin change
+ * interrupt for banks watched that way. A bit in port_stale forces a check
+ * of the port, because its expected state was changed.
+ */
+static volatile uint8_t port_shadow[PORT_BANKS];
+volatile uint8_t port_stale[PORT_BANKS];
+static const uint8_t port_mask[PORT_BANKS] = { PORT_MASKS };
+
+static inline void port_read(uint8_t *snap)
+{
+#ifdef PORT_BANK0_PIN
+	snap[0] = PORT_BANK0_PIN;
+#endif
+#ifdef PORT_BANK1_PIN
+	snap[1] = PORT_BANK1_PIN;
+#endif
+#ifdef PORT_BANK2_PIN
+	snap[2] = PORT_BANK2_PIN;
+#endif
+#ifdef PORT_BANK3_PIN
+	snap[3] = PORT_BANK3_PIN;
+#endif
+}
+
+#ifdef PORT_DEBOUNCE_TICK
+#ifndef HAVE_TIMER
+#error "Debouncing ports requires a timer"
+#endif
+/*
+ * Debouncing uses vertical counters: bit N of port_deb_cnt[bank][K] is bit K
+ * of pin N's counter, so one pass handles all pins of a bank. A pin which
+ * differs from its debounced state counts down once every PORT_DEBOUNCE_TICK
+ * msec; at zero, the new state is accepted. A pin which agrees with its
+ * debounced state reloads its counter, so a glitch never gets through.
+ */
+#define DEB_TICKS ((uint16_t)((uint32_t)PORT_DEBOUNCE_TICK*F_CPU/TIMER_PRESCALE/1000))
+
+static const uint8_t port_deb_mask[PORT_BANKS] = { PORT_DEB_MASKS };
+static const uint8_t port_deb_reload[PORT_BANKS][4] = { PORT_DEB_RELOAD };
+static uint8_t port_deb[PORT_BANKS]; // debounced state
+static uint8_t port_deb_cnt[PORT_BANKS][4];
+static uint16_t port_deb_last;
+
+/* One debounce step. Returns the pins whose debounced state changed. */
+static inline uint8_t port_debounce(uint8_t bank, uint8_t raw)
+{
+	uint8_t *c = port_deb_cnt[bank];
+	const uint8_t *r = port_deb_reload[bank];
+	uint8_t diff = (raw ^ port_deb[bank]) & port_deb_mask[bank];
+	uint8_t borrow = diff, done, load, k;
+
+	for(k=0;k<4;k++) {
+		uint8_t x = c[k];
+		c[k] = x ^ borrow;
+		borrow &= ~x;
 	}
+	done = diff & ~(c[0]|c[1]|c[2]|c[3]);
+	load = ~diff | done;
+	for(k=0;k<4;k++)
+		c[k] = (c[k] & ~load) | (r[k] & load);
+	port_deb[bank] ^= done;
+	return done;
 }
+#endif
 
-/* Each mainloop pass checks one port. */
-static uint8_t poll_next = 0;
+/* Read all port banks. Debounced pins report their stable state. */
+void port_sample(uint8_t *snap)
+{
+	port_read(snap);
+#ifdef PORT_DEBOUNCE_TICK
+	uint8_t i;
+	for(i=0;i<PORT_BANKS;i++)
+		snap[i] = (snap[i] & ~port_deb_mask[i]) | port_deb[i];
+#endif
+}
+
+#ifdef HAVE_PORT_IRQ
+#if !defined(PCMSK0)
+#error "This MCU does not have pin change interrupts"
+#endif
+
+#ifdef N_PORT_PULSE
+static const uint8_t port_bits[] __attribute__ ((progmem)) = { PORT_BITS };
+#endif
+static volatile uint8_t port_toggled[PORT_BANKS]; // changed since the last poll
+static volatile uint8_t port_pulsed[PORT_BANKS]; // changed more than once
+
+#ifdef N_PORT_PULSE
+/*
+ * Pulse capture. Each edge on a capture port stores the length of the pulse
+ * it ends, in timer ticks (at most 0x7FFF), with bit 15 set if the pulse
+ * was high. When the buffer is full, new pulses are dropped.
+ */
+typedef struct {
+	uint16_t last; // previous edge
+	uint8_t head, len; // oldest entry, number of entries
+	uint16_t t[PORT_PULSES];
+} port_pulse_t;
+static const uint8_t port_pulse_idx[] __attribute__ ((progmem)) = { PORT_PULSE_IDX };
+static port_pulse_t port_pulses[N_PORT_PULSE];
+
+static inline void port_pulse_add(port_pulse_t *pp, uint16_t now, uint8_t level)
+{
+	uint16_t t = now - pp->last;
+	uint8_t n = pp->len;
+
+	pp->last = now;
+	if (t > 0x7FFF)
+		t = 0x7FFF;
+	if (!level) // the pin is low now, so the pulse was high
+		t |= 0x8000;
+	if (n < PORT_PULSES) {
+		n += pp->head;
+		if (n >= PORT_PULSES)
+			n -= PORT_PULSES;
+		pp->t[n] = t;
+		pp->len++;
+	}
+}
+
+static port_pulse_t *port_pulse(port_t *portp)
+{
+	uint8_t c = pgm_read_byte(&port_pulse_idx[portp-ports]);
+	return c ? &port_pulses[c-1] : NULL;
+}
+
+uint8_t port_pulse_count(port_t *portp)
+{
+	port_pulse_t *pp = port_pulse(portp);
+	return pp ? pp->len : 0;
+}
+
+void port_pulse_read(port_t *portp, uint8_t *buf, uint8_t n)
+{
+	port_pulse_t *pp;
+	uint8_t i;
+
+	if (!n)
+		return;
+	pp = port_pulse(portp);
+	i = pp->head;
+	while(n--) {
+		uint16_t t = pp->t[i];
+		*buf++ = t>>8;
+		*buf++ = t;
+		if (++i == PORT_PULSES)
+			i = 0;
+	}
+}
+
+void port_pulse_drop(port_t *portp, uint8_t n)
+{
+	port_pulse_t *pp = port_pulse(portp);
+	uint8_t h = pp->head + n;
+	uint8_t sreg = SREG;
+
+	if (h >= PORT_PULSES)
+		h -= PORT_PULSES;
+	cli();
+	pp->head = h;
+	pp->len -= n;
+	SREG = sreg;
+}
+
+/*
+ * A pulse that's longer than the 16-bit timer can measure is reported as
+ * 0x7FFF ticks. Keep the last edge from moving out of range.
+ */
+static inline void poll_port_pulse(void)
+{
+	uint8_t i;
+	port_pulse_t *pp = port_pulses;
+
+	for(i=0;i<N_PORT_PULSE;i++,pp++) {
+		uint8_t sreg = SREG;
+		cli();
+		uint16_t now = timer_ticks();
+		if ((uint16_t)(now - pp->last) > 0x7FFF)
+			pp->last = now - 0x7FFF;
+		SREG = sreg;
+	}
+}
+#endif // N_PORT_PULSE
+
+/*
+ * Pin change: remember which pins changed. poll_port() does the
+ * rest. A pin that toggles twice between polls is a pulse, which must be
+ * reported even though the pin is back at its previous state.
+ *
+ * The bank's interrupt is masked while the rest runs with interrupts
+ * enabled, so a nested change on the same pins can't interfere with the
+ * counters' or the pulse buffers' updates. Such a change is handled as
+ * soon as we're done.
+ */
+static inline void port_irq(uint8_t bank, uint8_t pin, uint8_t mask, uint8_t pcie)
+{
+	uint8_t d = (pin ^ port_shadow[bank]) & mask;
+	port_shadow[bank] = pin;
+	port_pulsed[bank] |= d & port_toggled[bank];
+	port_toggled[bank] |= d;
+
+#ifdef HAVE_TIMER
+	uint16_t now = timer_ticks();
+#else
+	const uint16_t now __attribute__((unused)) = 0;
+#endif
+	PCICR &=~ pcie;
+	sei(); // don't delay the 1wire code
+
+#ifdef COUNT_IRQ_BITS
+	count_irq(bank, d, pin, now);
+#endif
+#ifdef N_PORT_PULSE
+	const uint8_t *pb = &port_bits[bank<<3];
+	while(d) {
+		if (d & 1) {
+			uint8_t i = pgm_read_byte(pb);
+			if (i) {
+				uint8_t c = pgm_read_byte(&port_pulse_idx[i-1]);
+				if (c)
+					port_pulse_add(&port_pulses[c-1], now, pin & 1);
+			}
+		}
+		d >>= 1;
+		pin >>= 1;
+		pb++;
+	}
+#endif
+	cli();
+	PCICR |= pcie;
+}
+
+#define _PORT_IRQ(_n) port_irq(_n, PORT_BANK##_n##_PIN, PORT_BANK##_n##_MASK, 1<<PORT_BANK##_n##_PCIE)
+#ifdef PORT_BANK0_VECT
+ISR(PORT_BANK0_VECT) { _PORT_IRQ(0); }
+#endif
+#ifdef PORT_BANK1_VECT
+ISR(PORT_BANK1_VECT) { _PORT_IRQ(1); }
+#endif
+#ifdef PORT_BANK2_VECT
+ISR(PORT_BANK2_VECT) { _PORT_IRQ(2); }
+#endif
+#ifdef PORT_BANK3_VECT
+ISR(PORT_BANK3_VECT) { _PORT_IRQ(3); }
+#endif
+#undef _PORT_IRQ
+
+static inline void init_port_irq(void)
+{
+#define _INIT_BANK(_n) do { \
+		PORT_BANK##_n##_PCMSK |= PORT_BANK##_n##_MASK; \
+		PCICR |= 1<<PORT_BANK##_n##_PCIE; \
+	} while(0)
+#ifdef PORT_BANK0_VECT
+	_INIT_BANK(0);
+#endif
+#ifdef PORT_BANK1_VECT
+	_INIT_BANK(1);
+#endif
+#ifdef PORT_BANK2_VECT
+	_INIT_BANK(2);
+#endif
+#ifdef PORT_BANK3_VECT
+	_INIT_BANK(3);
+#endif
+#undef _INIT_BANK
+}
+#endif // HAVE_PORT_IRQ
+
+/* Update the flags of all ports whose pin has changed. */
+static inline void poll_port_banks(void)
+{
+	uint8_t snap[PORT_BANKS], t[PORT_BANKS], p[PORT_BANKS];
+	uint8_t c[PORT_BANKS], con[PORT_BANKS];
+#ifdef PORT_DEBOUNCE_TICK
+	uint8_t st[PORT_BANKS];
+#endif
+	uint8_t i, any = 0;
+	port_t *pp;
+	uint8_t sreg = SREG;
+
+	cli();
+	port_read(snap);
+	for(i=0;i<PORT_BANKS;i++) {
+		uint8_t d = port_stale[i] | port_cmd[i];
+		c[i] = port_cmd[i];
+		con[i] = port_cmd_on[i];
+		port_cmd[i] = 0;
+#ifdef PORT_DEBOUNCE_TICK
+		st[i] = d;
+#endif
+		port_stale[i] = 0;
+#ifdef HAVE_PORT_IRQ
+		if (PORT_IRQ_BANKS & (1<<i)) {
+			d |= port_toggled[i];
+			p[i] = port_pulsed[i];
+			port_toggled[i] = 0;
+			port_pulsed[i] = 0;
+		} else
+#endif
+		{
+			d |= (snap[i] ^ port_shadow[i]) & port_mask[i];
+			port_shadow[i] = snap[i];
+			p[i] = 0;
+		}
+		p[i] &=~ c[i]; // our own edges are not pulses
+		t[i] = d;
+	}
+	SREG = sreg;
+
+#ifdef PORT_DEBOUNCE_TICK
+	/*
+	 * Debounced pins only change when their counter runs out. Glitches
+	 * and pulses on them are ignored. A pin that's been written to
+	 * switches immediately.
+	 */
+	uint16_t now = timer_ticks();
+	char step = (uint16_t)(now - port_deb_last) >= DEB_TICKS;
+	if (step)
+		port_deb_last = now;
+#endif
+	for(i=0;i<PORT_BANKS;i++) {
+#ifdef PORT_DEBOUNCE_TICK
+		uint8_t dm = port_deb_mask[i];
+		uint8_t d = st[i] & dm;
+		port_deb[i] ^= (snap[i] ^ port_deb[i]) & d;
+		if (step)
+			d |= port_debounce(i, snap[i]);
+		t[i] = (t[i] & ~dm) | d;
+		p[i] &= ~dm;
+		snap[i] = (snap[i] & ~dm) | port_deb[i];
+#endif
+		any |= t[i];
+	}
+	if (!any)
+		return;
+
+	pp = ports;
+	for(i=0;i<N_PORT;i++,pp++) {
+		uint8_t b = PORT_BANK_IDX(pp->adr>>3);
+		uint8_t m = 1<<(pp->adr & 0x07);
+		uint8_t flg = pp->flags;
+
+		if (!(t[b] & m))
+			continue;
+		// A level set by an interrupt is expected, not a change.
+		if (c[b] & m) {
+			flg &=~ PFLG_CURRENT;
+			if (con[b] & m)
+				flg |= PFLG_CURRENT;
+			pp->flags = flg;
+		}
+		if (!(snap[b] & m) != !(flg & PFLG_CURRENT) || (p[b] & m)) {
+			flg &=~ PFLG_CURRENT;
+			if (snap[b] & m)
+				flg |= PFLG_CURRENT;
+			pp->flags = flg | PFLG_CHANGED;
+		}
 #ifdef CONDITIONAL_SEARCH
-uint8_t port_changed_cache;
-static uint8_t max_seen = 0;
+		if ((pp->flags & (PFLG_CHANGED|PFLG_ALERT)) == (PFLG_CHANGED|PFLG_ALERT)) {
+			if (port_changed_cache <= i)
+				port_changed_cache = i+1;
+			if (max_seen <= i)
+				max_seen = i+1;
+		}
 #endif
+	}
+}
+
+/*
+ * Each mainloop pass samples all ports, but only updates those which have
+ * changed. For alerting, it also checks whether one port still needs to be
+ * reported.
+ */
 void poll_port(void)
 {
+	poll_port_banks();
+#ifdef N_PORT_PULSE
+	poll_port_pulse();
+#endif
+
+#ifdef CONDITIONAL_SEARCH
 	port_t *pp;
 	uint8_t i = poll_next;
 	if (i >= N_PORT) {
 		i=0;
-#ifdef CONDITIONAL_SEARCH
 		port_changed_cache = max_seen;
 		max_seen=0;
-#endif
 	}
 	pp = &ports[i];
 	i++;
-	port_check(pp);
-#ifdef CONDITIONAL_SEARCH
-	if(pp->flags & (PFLG_POLL|PFLG_CHANGED) && pp->flags & PFLG_ALERT)
+	if(pp->flags & (PFLG_POLL|PFLG_CHANGED) && pp->flags & PFLG_ALERT && max_seen < i)
 		max_seen = i;
-#endif
 	poll_next=i;
+#endif
 }
 
 void init_port(void)
@@ -133,6 +729,23 @@ void init_port(void)
 	}
 #ifdef CONDITIONAL_SEARCH
 	port_changed_cache = 0;
+#endif
+	port_read((uint8_t *)port_shadow);
+	memset((uint8_t *)port_stale,0,sizeof(port_stale));
+	memset((uint8_t *)port_cmd,0,sizeof(port_cmd));
+#ifdef PORT_DEBOUNCE_TICK
+	for(i=0;i<PORT_BANKS;i++) {
+		port_deb[i] = port_shadow[i] & port_deb_mask[i];
+		memcpy(port_deb_cnt[i], port_deb_reload[i], 4);
+	}
+	port_deb_last = timer_ticks();
+#endif
+#ifdef HAVE_PORT_IRQ
+#ifdef N_PORT_PULSE
+	for(i=0;i<N_PORT_PULSE;i++)
+		port_pulses[i].last = timer_ticks();
+#endif
+	init_port_irq();
 #endif
 }
 
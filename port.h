@@ -1,11 +1,15 @@
 #ifndef PORT_H
 #define PORT_H
 
+#include <avr/io.h>
+#include <avr/interrupt.h>
 #include "dev_data.h"
 #include "features.h"
 
 #if defined(N_PORT)
 
+#include "_port.h"
+
 typedef struct {
 	uint8_t adr;
 	uint8_t flags;
@@ -82,20 +86,48 @@ static inline port_out_t port_get_out(port_t *portp) {
 	return _P_GET(port) | (!_P_GET(ddr)<<1) ;
 }
 
-// set intended port state
-static inline void port_set_out(port_t *portp, port_out_t state) {
+/* Ports whose expected state has changed, by bank; see port.c */
+extern volatile uint8_t port_stale[];
+
+// set port registers. Interrupts may do this too, so don't get interrupted
+static inline void port_set_reg(port_t *portp, port_out_t state) {
 	_P_VARS(portp)
+	uint8_t sreg = SREG;
+	cli();
 	_P_SET(port, state&1);
 	_P_SET(ddr,!(state&2));
+	port_stale[PORT_BANK_IDX(portp->adr>>3)] |= adr;
+	SREG = sreg;
+}
+
+// set intended port state
+static inline void port_set_out(port_t *portp, port_out_t state) {
+	port_set_reg(portp, state);
 	portp->flags = (portp->flags&~PFLG_CURRENT) | (state<<7);
 }
 
-// update flags based on current port state
-void port_check(port_t *pp);
+// read the input registers of all port banks
+void port_sample(uint8_t *snap);
+
+// set a port's registers only; safe to call from interrupts
+void port_set_pin(port_t *portp, char val);
 
 // Set port to 0/1 according to mode (PFLG_ALT*). This is harder than it seems.
 void port_set(port_t *portp, char val);
 
+// Same thing, for all ports in the MASK bitmap, atomically
+void port_set_many(const uint8_t *mask, const uint8_t *val);
+
+#ifdef N_PORT_SEQ
+/* Output sequences: set the port to VAL[i] after DELAY[i] msec, in turn.
+ * Any other write to the port cancels its sequence. */
+char port_has_seq(port_t *portp);
+void port_seq_start(port_t *portp, const uint8_t *steps, uint8_t n);
+void port_seq_stop(port_t *portp);
+// called from the timer interrupt
+void port_seq_timer(void);
+#endif
+
 
 static inline char port_changed(port_t *portp) {
 	return portp->flags & PFLG_CHANGED;
@@ -104,6 +136,14 @@ static inline char port_changed(port_t *portp) {
 /* Number of highest port that has a change +1  */
 extern uint8_t port_changed_cache;
 
+#ifdef N_PORT_PULSE
+/* Captured pulses: bits 0-14 are the length in timer ticks, bit 15 is set
+ * for a high pulse. port_pulse_count() is zero for other ports. */
+uint8_t port_pulse_count(port_t *portp);
+void port_pulse_read(port_t *portp, uint8_t *buf, uint8_t n);
+void port_pulse_drop(port_t *portp, uint8_t n);
+#endif
+
 /* Note whether a port has changed */
 static inline char port_has_changed(port_t *portp) {
 	uint8_t flg = portp->flags;
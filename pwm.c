@@ -20,6 +20,7 @@
 #include <avr/interrupt.h>
 #include "pgm.h"
 #include <string.h>
+#include <stddef.h>
 
 #include "port.h"
 #include "pwm.h"
@@ -38,39 +39,551 @@ pwm_t pwms[] = {
 
 #ifdef CONDITIONAL_SEARCH
 uint8_t pwm_changed_cache;
-#endif
 
-void poll_pwm(void)
+void pwm_alert_update(void)
 {
 	uint8_t i;
 	pwm_t *t = pwms;
-	port_t *p;
+
+	pwm_changed_cache = 0;
+	for(i=0;i<N_PWM;i++,t++)
+		if (t->flags & PWM_IS_ALERT)
+			pwm_changed_cache = i+1;
+}
+#endif
+
+#ifdef HAVE_PWM_TIMER1
+#ifdef COUNT_TIMER1
+#error "Timer1 can't count pulses and do PWM at the same time"
+#endif
+/*
+ * Timer1 runs in fast PWM mode; its compare outputs drive the pins
+ * without any help from the CPU. The duty cycle is t_on/(t_on+t_off),
+ * scaled to the timer's resolution.
+ */
+#define PWM_TOP ((1<<PWM_BITS)-1)
+#if PWM_BITS == 8
+#define PWM_WGM (1<<WGM10)
+#elif PWM_BITS == 9
+#define PWM_WGM (1<<WGM11)
+#elif PWM_BITS == 10
+#define PWM_WGM ((1<<WGM11)|(1<<WGM10))
+#else
+#error "pwm_bits must be 8, 9 or 10"
+#endif
+
+#if PWM_PRESCALE == 1
+#define PWM_CS 0x01
+#elif PWM_PRESCALE == 8
+#define PWM_CS 0x02
+#elif PWM_PRESCALE == 64
+#define PWM_CS 0x03
+#elif PWM_PRESCALE == 256
+#define PWM_CS 0x04
+#elif PWM_PRESCALE == 1024
+#define PWM_CS 0x05
+#else
+#error "pwm_prescale must be 1, 8, 64, 256 or 1024"
+#endif
+
+void pwm_hw_set(pwm_t *t)
+{
+	uint16_t duty;
+	uint8_t com, sreg;
+
+	if (!t->t_on)
+		duty = 0;
+	else if (!t->t_off)
+		duty = PWM_TOP;
+	else {
+		uint32_t sum = (uint32_t)t->t_on + t->t_off;
+		duty = ((uint32_t)t->t_on*(PWM_TOP+1) + sum/2) / sum;
+		if (duty > PWM_TOP)
+			duty = PWM_TOP;
+	}
+	com = (t->flags & PWM_OC1B) ? (1<<COM1B1) : (1<<COM1A1);
+
+	sreg = SREG;
+	cli();
+	if (!duty) {
+		// A compare value of zero still emits a one-clock spike,
+		// so disconnect the output and let the port drive the pin.
+		TCCR1A &=~ com;
+		t->flags &=~ PWM_IS_ON;
+	} else {
+		if (t->flags & PWM_OC1B)
+			OCR1B = duty;
+		else
+			OCR1A = duty;
+		TCCR1A |= com;
+		t->flags |= PWM_IS_ON;
+	}
+	SREG = sreg;
+}
+
+static inline void init_pwm_timer1(void)
+{
+	TCCR1A = PWM_WGM;
+	TCNT1 = 0;
+	TCCR1B = (1<<WGM12) | PWM_CS;
+}
+#endif // HAVE_PWM_TIMER1
+
+#ifdef N_PWM_FAST
+#ifndef HAVE_TIMER
+#error "Fast PWM requires a timer"
+#endif
+#ifndef OCIE0B
+#error "Fast PWM requires Timer0's second compare unit"
+#endif
+/*
+ * Fast PWMs are switched by the Timer0 compare B interrupt. Their next
+ * edges are kept in a queue which is sorted by time, so each interrupt
+ * only looks at the edges that are due, and then sets the compare
+ * register to the next one. Edges more than 255 ticks away are armed
+ * by the periodic timer interrupt.
+ *
+ * Both interrupts run with interrupts enabled, so pwm_fast_run() may be
+ * re-entered. The nested call only tells the running one to go again.
+ */
+
+typedef struct {
+	uint16_t when; // timer_ticks() of the next edge
+	uint8_t pwm; // index into pwms[]
+} pwm_fast_t;
+
+static pwm_fast_t pwm_fast_q[N_PWM_FAST];
+static uint8_t pwm_fast_n;
+static volatile uint8_t pwm_fast_busy; // 1: running, 2: run again
+static volatile char pwm_fast_pending; // some PWM has PWM_START set
 #ifdef CONDITIONAL_SEARCH
-	uint8_t max_seen = 0;
+static volatile char pwm_fast_alerted; // poll_pwm() needs to look
 #endif
 
-	for(i=0;i<N_PWM;t++) {
-		i++;
-		uint16_t tx = (t->flags & PWM_IS_ON) ? t->t_on : t->t_off;
-		if(tx == 0)
+static void pwm_fast_insert(uint16_t when, uint8_t pwm, uint16_t now)
+{
+	uint8_t i = pwm_fast_n++;
+
+	while(i && (uint16_t)(pwm_fast_q[i-1].when - now) > (uint16_t)(when - now)) {
+		pwm_fast_q[i] = pwm_fast_q[i-1];
+		i--;
+	}
+	pwm_fast_q[i].when = when;
+	pwm_fast_q[i].pwm = pwm;
+}
+
+static void pwm_fast_remove(uint8_t i)
+{
+	pwm_fast_n--;
+	for(;i<pwm_fast_n;i++)
+		pwm_fast_q[i] = pwm_fast_q[i+1];
+}
+
+/* Switch a PWM to its next phase. Returns the length of that phase. */
+static uint16_t pwm_fast_toggle(pwm_t *t)
+{
+	uint16_t tx;
+
+	t->flags ^= PWM_IS_ON;
+	port_set_pin(&ports[t->port-1], t->flags & PWM_IS_ON);
+	tx = (t->flags & PWM_IS_ON) ? t->t_on : t->t_off;
+#ifdef CONDITIONAL_SEARCH
+	if (!tx && (t->flags & PWM_ALERT)) {
+		t->flags |= PWM_IS_ALERT;
+		pwm_fast_alerted = 1;
+	}
+#endif
+	return (tx > PWM_FAST_MAX) ? PWM_FAST_MAX : tx;
+}
+
+static void pwm_fast_restart(uint16_t now)
+{
+	uint8_t i,j;
+	pwm_t *t = pwms;
+
+	pwm_fast_pending = 0;
+	for(i=0;i<N_PWM;i++,t++) {
+		if (!(t->flags & PWM_START))
 			continue;
-		if(timer_done(&t->timer)) {
-			p = &ports[t->port-1];
-			t->flags ^= PWM_IS_ON;
-			port_set(p, t->flags & PWM_IS_ON);
-			tx = (t->flags & PWM_IS_ON) ? t->t_on : t->t_off;
-			if (tx)
-				timer_start(tx-timer_remaining(&t->timer),&t->timer);
+		t->flags &=~ PWM_START;
+		for(j=0;j<pwm_fast_n;j++)
+			if (pwm_fast_q[j].pwm == i) {
+				pwm_fast_remove(j);
+				break;
+			}
+		// like timer_reset(): the current phase is over now
+		if ((t->flags & PWM_IS_ON) ? t->t_on : t->t_off)
+			pwm_fast_insert(now, i, now);
+	}
+}
+
+static void pwm_fast_step(void)
+{
+	uint8_t sreg = SREG;
+	uint8_t c, m;
+	uint16_t now, tx;
+	int16_t d;
+
+	for(;;) {
+		now = timer_ticks();
+		if (pwm_fast_pending)
+			pwm_fast_restart(now);
+		while(pwm_fast_n && (int16_t)(pwm_fast_q[0].when - now) <= 0) {
+			pwm_fast_t e = pwm_fast_q[0];
+
+			pwm_fast_remove(0);
+			tx = pwm_fast_toggle(&pwms[e.pwm]);
+			if (!tx)
+				continue;
+			e.when += tx;
+			if ((int16_t)(e.when - now) <= 0) // too late: don't try to catch up
+				e.when = now + tx;
+			pwm_fast_insert(e.when, e.pwm, now);
+		}
+
+		cli();
+		c = TCNT0;
+		now = timer_ticks();
+		if (!pwm_fast_n)
+			goto off;
+		d = pwm_fast_q[0].when - now;
+		if (d <= 0) {
+			SREG = sreg;
+			continue;
+		}
+		// Too far away for the 8-bit counter: the timer interrupt will
+		// call us again.
+		if (d > 255)
+			goto off;
+		m = c + d;
+		OCR0B = m;
+		TIFR0 = (1<<OCF0B);
+		TIMSK0 |= (1<<OCIE0B);
+		if ((uint8_t)(TCNT0 - c) < d) // otherwise we were too slow
+			break;
+		SREG = sreg;
+	}
+	SREG = sreg;
+	return;
+off:
+	TIMSK0 &=~ (1<<OCIE0B);
+	SREG = sreg;
+}
+
+void pwm_fast_run(void)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	if (pwm_fast_busy) {
+		pwm_fast_busy = 2;
+		SREG = sreg;
+		return;
+	}
+	pwm_fast_busy = 1;
+	SREG = sreg;
+	for(;;) {
+		pwm_fast_step();
+		cli();
+		if (pwm_fast_busy == 1)
+			break;
+		pwm_fast_busy = 1;
+		SREG = sreg;
+	}
+	pwm_fast_busy = 0;
+	SREG = sreg;
+}
+
+uint16_t pwm_fast_left(pwm_t *t)
+{
+	uint8_t i, sreg = SREG;
+	uint16_t left = 0;
+
+	cli();
+	for(i=0;i<pwm_fast_n;i++)
+		if (&pwms[pwm_fast_q[i].pwm] == t) {
+			left = pwm_fast_q[i].when - timer_ticks();
+			if ((int16_t)left < 0)
+				left = 0;
+			break;
+		}
+	SREG = sreg;
+	return left;
+}
+
+void pwm_fast_start(pwm_t *t)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	t->flags |= PWM_START;
+	pwm_fast_pending = 1;
+	SREG = sreg;
+}
+
+ISR(TIMER0_COMPB_vect, ISR_NOBLOCK)
+{
+	pwm_fast_run();
+}
+#endif // N_PWM_FAST
+
+#ifdef PWM_STAGGER
+/*
+ * Software PWMs with the same period would all switch on at the same
+ * time. Instead, each one switches on at a fixed offset into its period,
+ * counted from the start of the clock: software PWM i of N starts at i/N
+ * of it. Hardware and fast PWMs don't take a slot.
+ */
+static const uint8_t pwm_soft_idx[] __attribute__ ((progmem)) = { PWM_SOFT_IDX };
+
+uint32_t pwm_phase(pwm_t *t)
+{
+	return ((uint32_t)t->t_on + t->t_off) * pgm_read_byte(&pwm_soft_idx[t-pwms]) / N_PWM_SOFT;
+}
+
+/* Time from NOW until the PWM's next slot; DEF if it's exactly now */
+static uint32_t pwm_slot_wait(pwm_t *t, uint32_t now, uint32_t def)
+{
+	uint32_t p = (uint32_t)t->t_on + t->t_off;
+	uint32_t r = (now - pwm_phase(t)) % p;
+
+	return r ? p-r : def;
+}
+#endif
+
+void pwm_set(pwm_t *t, uint16_t on, uint16_t off, char force)
+{
+	uint16_t last;
+
+#ifdef N_PWM_FAST
+	if (t->flags & PWM_FAST) {
+		// the timer interrupt reads these
+		uint8_t sreg = SREG;
+		cli();
+		last = ((t->flags & PWM_IS_ON) ? t->t_on : t->t_off);
+		t->t_on = on;
+		t->t_off = off;
+		t->flags &=~ PWM_IS_ALERT;
+		SREG = sreg;
+#ifdef CONDITIONAL_SEARCH
+		pwm_alert_update();
+#endif
+		if(!last || force)
+			pwm_fast_start(t);
+		pwm_fast_run();
+		return;
+	}
+#endif
+	last = ((t->flags & PWM_IS_ON) ? t->t_on : t->t_off);
+	t->t_on = on;
+	t->t_off = off;
 #ifdef CONDITIONAL_SEARCH
-			else if(t->flags & PWM_ALERT)
-				t->flags |= PWM_IS_ALERT;
-			if (t->flags & PWM_IS_ALERT)
-				max_seen = i;
+	if (t->flags & PWM_IS_ALERT) {
+		t->flags &=~ PWM_IS_ALERT;
+		pwm_alert_update();
+	}
+#endif
+#ifdef HAVE_PWM_TIMER1
+	if (t->flags & PWM_TIMER1) {
+		pwm_hw_set(t);
+		return;
+	}
 #endif
+	if(!last || force) {
+#ifdef PWM_STAGGER
+		// Switch on at the next slot, or off right now
+		if (on && off && !(t->flags & PWM_IS_ON)) {
+			uint32_t now = timer_now();
+			timer_call_at(&t->call, now + pwm_slot_wait(t, now, 0));
+			return;
 		}
+#endif
+		timer_call_in(&t->call, 0);
+	}
+}
+
+#ifdef N_PWM_FADE
+#ifndef HAVE_TIMER
+#error "PWM fades require a timer"
+#endif
+/*
+ * Fades move a PWM's on and off times to new values, in 10-msec steps
+ * driven by poll_pwm(). Linear fades interpolate both times. Gamma fades
+ * interpolate the period linearly and the square root of the duty cycle,
+ * which looks like an even change in brightness.
+ */
+#define FADE_TICKS (F_CPU/TIMER_PRESCALE/100) // 10 msec
+
+typedef struct {
+	uint16_t on0, off0, on1, off1; // from, to
+	uint16_t s0, s1; // gamma: square roots of the duty cycles
+	uint16_t pos, steps; // steps is zero if idle
+	uint8_t curve;
+} pwm_fade_t;
+
+static const uint8_t pwm_fade_idx[] __attribute__ ((progmem)) = { PWM_FADE_IDX };
+static const uint8_t pwm_fade_pwm[] __attribute__ ((progmem)) = { PWM_FADE_PWMS };
+static pwm_fade_t pwm_fades[N_PWM_FADE];
+static uint16_t pwm_fade_last;
+static uint8_t pwm_fade_active;
+
+static pwm_fade_t *pwm_fade(pwm_t *t)
+{
+	uint8_t c = pgm_read_byte(&pwm_fade_idx[t-pwms]);
+	return c ? &pwm_fades[c-1] : NULL;
+}
+
+char pwm_has_fade(pwm_t *t)
+{
+	return pwm_fade(t) != NULL;
+}
+
+/* Square root of the duty cycle, 0…4095 */
+static uint16_t pwm_fade_sqrt(uint16_t on, uint16_t off)
+{
+	uint32_t p = (uint32_t)on + off;
+	uint32_t x;
+	uint16_t r = 0, b = 1<<11;
+
+	if (!p)
+		return 0;
+	x = (((uint32_t)on << 15) / p) << 9; // duty, 0…1<<24
+	for(;b;b >>= 1) {
+		uint16_t t = r|b;
+		if ((uint32_t)t*t <= x)
+			r = t;
 	}
+	return r;
+}
+
+static void pwm_fade_step(pwm_t *t, pwm_fade_t *fd)
+{
+	uint32_t on, off;
+
+	if (fd->pos >= fd->steps) {
+		on = fd->on1;
+		off = fd->off1;
+		fd->steps = 0;
+		pwm_fade_active--;
+	} else {
+		int16_t f = ((uint32_t)fd->pos << 12) / fd->steps; // 0…4095
+
+		if (fd->curve == PWM_CURVE_GAMMA) {
+			uint32_t p0 = (uint32_t)fd->on0 + fd->off0;
+			int32_t dp = (int32_t)fd->on1 + fd->off1 - (int32_t)p0;
+			uint32_t p = p0 + ((dp * f) >> 12);
+			uint16_t s = fd->s0 + ((((int32_t)fd->s1 - fd->s0) * f) >> 12);
+
+			on = (p * (((uint32_t)s*s) >> 9)) >> 15;
+			off = p - on;
+		} else {
+			on = fd->on0 + ((((int32_t)fd->on1 - fd->on0) * f) >> 12);
+			off = fd->off0 + ((((int32_t)fd->off1 - fd->off0) * f) >> 12);
+		}
+		if (on > 0xFFFF)
+			on = 0xFFFF;
+		if (off > 0xFFFF)
+			off = 0xFFFF;
+	}
+	pwm_set(t, on, off, 0);
+}
+
+void pwm_fade_start(pwm_t *t, uint16_t on, uint16_t off, uint16_t tenths, uint8_t curve)
+{
+	pwm_fade_t *fd = pwm_fade(t);
+
+	if (!tenths) {
+		pwm_fade_stop(t);
+		pwm_set(t, on, off, t->flags & PWM_FORCE);
+		return;
+	}
+	if (!fd->steps && !pwm_fade_active++)
+		pwm_fade_last = timer_ticks();
+	fd->on0 = t->t_on;
+	fd->off0 = t->t_off;
+	fd->on1 = on;
+	fd->off1 = off;
+	fd->curve = curve;
+	if (curve == PWM_CURVE_GAMMA) {
+		fd->s0 = pwm_fade_sqrt(fd->on0, fd->off0);
+		fd->s1 = pwm_fade_sqrt(on, off);
+	}
+	fd->pos = 0;
+	fd->steps = tenths*10;
+}
+
+void pwm_fade_stop(pwm_t *t)
+{
+	pwm_fade_t *fd = pwm_fade(t);
+
+	if (fd && fd->steps) {
+		fd->steps = 0;
+		pwm_fade_active--;
+	}
+}
+
+static void poll_pwm_fade(void)
+{
+	uint16_t now = timer_ticks();
+	uint8_t i, n = 0;
+	pwm_fade_t *fd = pwm_fades;
+
+	while((uint16_t)(now - pwm_fade_last) >= FADE_TICKS) {
+		pwm_fade_last += FADE_TICKS;
+		if (++n == 255) { // way behind
+			pwm_fade_last = now;
+			break;
+		}
+	}
+	if (!n)
+		return;
+	for(i=0;i<N_PWM_FADE;i++,fd++) {
+		if (!fd->steps)
+			continue;
+		fd->pos = (fd->steps - fd->pos > n) ? fd->pos+n : fd->steps;
+		pwm_fade_step(&pwms[pgm_read_byte(&pwm_fade_pwm[i])], fd);
+	}
+}
+#endif // N_PWM_FADE
+
+/* A software PWM's phase is over */
+static void pwm_timer(timer_call_t *tc)
+{
+	pwm_t *t = (pwm_t *)((char *)tc - offsetof(pwm_t, call));
+	uint16_t tx = (t->flags & PWM_IS_ON) ? t->t_on : t->t_off;
+
+	if(tx == 0) // stopped in this phase
+		return;
+	t->flags ^= PWM_IS_ON;
+	port_set(&ports[t->port-1], t->flags & PWM_IS_ON);
+	tx = (t->flags & PWM_IS_ON) ? t->t_on : t->t_off;
+#ifdef PWM_STAGGER
+	// The off phase ends at the PWM's next slot
+	if (tx && !(t->flags & PWM_IS_ON) && t->t_on)
+		tx = pwm_slot_wait(t, tc->when, tx);
+#endif
+	if (tx)
+		timer_call_at(tc, tc->when+tx);
 #ifdef CONDITIONAL_SEARCH
-	pwm_changed_cache = max_seen;
+	else if(t->flags & PWM_ALERT) {
+		t->flags |= PWM_IS_ALERT;
+		pwm_alert_update();
+	}
+#endif
+}
+
+/* Software PWMs run from the timer's scheduled calls. */
+void poll_pwm(void)
+{
+#ifdef N_PWM_FADE
+	if (pwm_fade_active)
+		poll_pwm_fade();
+#endif
+#if defined(N_PWM_FAST) && defined(CONDITIONAL_SEARCH)
+	if (pwm_fast_alerted) {
+		pwm_fast_alerted = 0;
+		pwm_alert_update();
+	}
 #endif
 }
 
@@ -80,13 +593,27 @@ void init_pwm(void)
 	port_t *p;
 	uint8_t i;
 
+#ifdef HAVE_PWM_TIMER1
+	init_pwm_timer1();
+#endif
 	for(i=0;i<N_PWM;i++,t++) {
 		p = &ports[t->port-1];
 		t->flags &=~ PWM_IS_ON;
 		// t->t_on = t->t_off = 0;
 		port_set(p,0);
+#ifdef HAVE_PWM_TIMER1
+		if (t->flags & PWM_TIMER1) {
+			pwm_hw_set(t);
+			continue;
+		}
+#endif
+#ifdef N_PWM_FAST
+		if (t->flags & PWM_FAST)
+			continue;
+#endif
+		t->call.fn = pwm_timer;
 		if(t->t_off)
-			timer_start(t->t_off, &t->timer);
+			timer_call_in(&t->call, t->t_off);
 	}
 }
 
@@ -10,15 +10,59 @@
 typedef struct {
 	uint8_t port;
 	uint8_t flags;
-	timer_t timer;
+	timer_call_t call;
 	uint16_t t_on,t_off;
 #define PWM_ALERT    (1<<0) // alert when one-shot PWM stops
 #define PWM_FORCE    (1<<1) // switch immediately when setting PWM
+#define PWM_TIMER1   (1<<2) // hardware PWM, on Timer1's compare output
+#define PWM_OC1B     (1<<3) // … B (else A)
+#define PWM_FAST     (1<<4) // software PWM, in timer ticks, by interrupt
+#define PWM_START    (1<<5) // fast PWM: (re)start at the next run
 #define PWM_IS_ALERT (1<<6) // alert present
 #define PWM_IS_ON    (1<<7) // PWM is in OM phase
 } pwm_t;
 
 extern pwm_t pwms[];
 
+#ifdef PWM_STAGGER
+/* Offset of a software PWM's on phase into its period */
+uint32_t pwm_phase(pwm_t *t);
+#endif
+
+/* Set a PWM's on and off times. FORCE ends the current phase now. */
+void pwm_set(pwm_t *t, uint16_t on, uint16_t off, char force);
+
+#ifdef N_PWM_FADE
+/* Fades. Writing to the PWM in any other way stops them. */
+#define PWM_CURVE_LINEAR 0
+#define PWM_CURVE_GAMMA  1
+#define PWM_FADE_MAX 6553 // tenths of a second
+char pwm_has_fade(pwm_t *t);
+void pwm_fade_start(pwm_t *t, uint16_t on, uint16_t off, uint16_t tenths, uint8_t curve);
+void pwm_fade_stop(pwm_t *t);
+#endif
+
+#ifdef CONDITIONAL_SEARCH
+/* Recalculate the alert cache after changing PWM_IS_ALERT */
+void pwm_alert_update(void);
+#endif
+
+#ifdef HAVE_PWM_TIMER1
+/* Update a hardware PWM's duty cycle from t_on and t_off */
+void pwm_hw_set(pwm_t *t);
+#endif
+
+#ifdef N_PWM_FAST
+#define PWM_FAST_MAX 0x7FFF // ticks; edges are compared relative to "now"
+/* Fast PWM: apply the edges that are due, (re)start the PWMs marked with
+ * PWM_START, and arm the timer for the next edge. Called from the timer
+ * interrupts, and by the main loop after changing a fast PWM. */
+void pwm_fast_run(void);
+/* Timer ticks until this fast PWM's next edge; zero if idle */
+uint16_t pwm_fast_left(pwm_t *t);
+/* Restart a fast PWM, like timer_reset(). Call pwm_fast_run() afterwards. */
+void pwm_fast_start(pwm_t *t);
+#endif
+
 #endif // any PWMs at all
 #endif // pwm_h
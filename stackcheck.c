@@ -0,0 +1,76 @@
+/*
+ *  Copyright © 2014-2015, Matthias Urlichs <matthias@urlichs.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License (included; see the file LICENSE)
+ *  for more details.
+ */
+
+/* This code monitors how much of the RAM between static data and the
+ * stack is ever used.
+ *
+ * At startup, all of it is painted with STACK_PAINT. The main loop then
+ * scans the painted area from the bottom, a few bytes at a time. The first
+ * byte that has been overwritten marks the deepest point the stack has
+ * reached. If that ever hits the end of .bss, the stack has overrun
+ * your variables.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "features.h"
+#include "stackcheck.h"
+
+#ifdef HAVE_STACKCHECK
+
+#define STACK_SCAN 8 // bytes to check per call
+
+uint8_t *stack_low;
+uint8_t *stack_top;
+static uint8_t *stack_pos;
+
+// Runs before .data and .bss are set up; must not use either.
+void stack_paint(void) __attribute__((naked,used,section(".init3")));
+void stack_paint(void)
+{
+	uint8_t *p = &__heap_start;
+	while(p < (uint8_t *)SP)
+		*p++ = STACK_PAINT;
+}
+
+void stackcheck_init(void)
+{
+	stack_top = (uint8_t *)SP;
+	stack_low = stack_top;
+	stack_pos = &__heap_start;
+}
+
+void stackcheck_poll(void)
+{
+	uint8_t *p = stack_pos;
+	uint8_t n = STACK_SCAN;
+
+	do {
+		if (p >= stack_low) {
+			p = &__heap_start;
+			break;
+		}
+		if (*p != STACK_PAINT) {
+			stack_low = p;
+			p = &__heap_start;
+			break;
+		}
+		p++;
+	} while(--n);
+	stack_pos = p;
+}
+
+#endif // HAVE_STACKCHECK
@@ -0,0 +1,56 @@
+#ifndef STACKCHECK_H
+#define STACKCHECK_H
+
+/*
+ *  Copyright © 2014-2015, Matthias Urlichs <matthias@urlichs.de>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License (included; see the file LICENSE)
+ *  for more details.
+ */
+
+#include "dev_data.h"
+#include "features.h"
+
+#ifdef HAVE_STACKCHECK
+
+/* Unused RAM is filled with this at startup */
+#define STACK_PAINT 0xC5
+
+/* End of static data, i.e. the lowest address the stack may use */
+extern uint8_t __heap_start;
+
+/* Lowest address the stack has been seen to reach */
+extern uint8_t *stack_low;
+/* Initial stack pointer, i.e. the top of the painted area */
+extern uint8_t *stack_top;
+
+/* Bytes between the end of static data and the deepest stack use */
+static inline uint16_t stack_free(void) {
+	return stack_low - &__heap_start;
+}
+/* Bytes between the end of static data and the initial stack */
+static inline uint16_t stack_size(void) {
+	return stack_top - &__heap_start;
+}
+
+void stackcheck_init(void);
+
+/* Scan a few bytes of the painted area. Call this from the main loop. */
+void stackcheck_poll(void);
+
+#else // !HAVE_STACKCHECK
+
+#define stackcheck_init() do {} while(0)
+#define stackcheck_poll() do {} while(0)
+
+#endif // HAVE_STACKCHECK
+
+#endif // stackcheck_h
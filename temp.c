@@ -22,6 +22,7 @@
 #include <string.h>
 
 #include "temp.h"
+#include "filter.h"
 #include "features.h"
 #include "moat.h"
 #include "dev_data.h"
@@ -40,6 +41,34 @@ static const temp_call_t temp_calls[N_TEMP_DRIVER] __attribute__((progmem)) = {
 };
 #undef TEMP_TC_DEFINE
 
+#ifdef N_TEMP_FLT
+static const uint8_t temp_flt_idx[] __attribute__ ((progmem)) = { TEMP_FLT_IDX };
+static const uint8_t temp_flt_mode[] __attribute__ ((progmem)) = { TEMP_FLT_MODE };
+static filter_t temp_flt[N_TEMP_FLT];
+#ifdef TEMP_FLT_BUF
+static const uint8_t temp_flt_off[] __attribute__ ((progmem)) = { TEMP_FLT_OFF };
+static uint16_t temp_flt_buf[TEMP_FLT_BUF];
+#endif
+
+/* The filter works on unsigned values, so flip the sign bit */
+static inline int16_t temp_filter(uint8_t i, int16_t temp)
+{
+	uint8_t c = pgm_read_byte(&temp_flt_idx[i]);
+#ifdef TEMP_FLT_BUF
+	uint16_t *buf;
+#else
+	uint16_t *buf = NULL;
+#endif
+
+	if (!c--)
+		return temp;
+#ifdef TEMP_FLT_BUF
+	buf = &temp_flt_buf[pgm_read_byte(&temp_flt_off[c])];
+#endif
+	return filter_step(&temp_flt[c], pgm_read_byte(&temp_flt_mode[c]), buf, temp ^ 0x8000) ^ 0x8000;
+}
+#endif
+
 /* Each mainloop pass checks one temp. */
 static uint8_t poll_this = 0;
 static uint8_t poll_step = 0;
@@ -66,6 +95,10 @@ void poll_temp(void)
 	temp = tfp(tt->device);
 	if (temp == TEMP_AGAIN)
 		return;
+#ifdef N_TEMP_FLT
+	temp = temp_filter(i, temp);
+#endif
+	tt->value = temp;
 
 	i += 1;
 	if (tt->flags & TEMP_ALERT) {
@@ -94,6 +127,10 @@ void init_temp(void)
 		temp_setup_fn *tfs = pgm_read_ptr(&tc->setup);
 		tfs(tt->device);
 	}
+#ifdef N_TEMP_FLT
+	for(i=0;i<N_TEMP_FLT;i++)
+		filter_init(&temp_flt[i]);
+#endif
 }
 
 
@@ -28,42 +28,49 @@
 #include "dev_data.h"
 #include "debug.h"
 #include "moat_internal.h"
+#include "port.h"
+#include "pwm.h"
 
 #ifdef HAVE_TIMER
 
-#define CLOCKS 125 // timer0 is 8-bit, so <=255
-#define PRESCALE 256
-#define SUB (F_CPU/10/PRESCALE/CLOCKS) // clocks per msec
-// 10: accuracy (10th of a second)
-// PRESCALE: prescaler
-// CLOCKS: timeout
-// This results in a nice integer value for 8/16 MHz
-
-// For 20MHz, alternating between N and N+1 results in an error of .0064% instead of 0.8%
-// good enough, given the xtal precision
-#if (F_CPU == 20000000) && (PRESCALE == 256)
-#define SUB2 (SUB+SUB+1)
-#else
-#define SUB2 0
+#ifndef OCIE0A
+#error "The timer needs Timer0's compare unit"
 #endif
-
-static int16_t current = 0;
-static uint8_t sub = 0;
-#if SUB2
-static uint8_t nsub = SUB;
+#if F_CPU % 1000
+#error "F_CPU must be a multiple of 1000"
 #endif
 
+#define CLOCKS TIMER_CLOCKS
+#define PRESCALE TIMER_PRESCALE
+#define MS_CLOCKS (F_CPU/1000)
+
+/*
+ * Timer0 runs freely. Its compare match interrupt is moved forward by
+ * CLOCKS every time, so the counter is never written to and no ticks
+ * are lost. "ticks" is the tick count at TCNT0==tick_ocr.
+ *
+ * The millisecond clock adds the interrupt's period, in CPU clocks, to
+ * "ms_rem", and carries whole milliseconds to "ms". This is exact for
+ * any F_CPU; tenths of a second are derived from it.
+ */
+static uint32_t current = 0; // tenths
+static volatile uint16_t ticks = 0;
+static volatile uint8_t tick_ocr = 0;
+static uint32_t ms = 0;
+static uint16_t ms_rem = 0; // CPU clocks, < MS_CLOCKS
+static uint8_t ms_tenth = 0;
+
 /* return True every MS milliseconds */
 char timer_done(timer_t *t)
 {
-	if((current - t->last) >= 0)
+	if(((int16_t)current - t->last) >= 0)
 		return 1;
 	return 0;
 }
 
 int16_t timer_remaining(timer_t *t)
 {
-	return t->last-current;
+	return t->last-(int16_t)current;
 }
 
 void timer_start(int16_t sec, timer_t *t)
@@ -73,16 +80,44 @@ void timer_start(int16_t sec, timer_t *t)
 
 void timer_reset(timer_t *t)
 {
-	t->last = current;
+	t->last = (int16_t)current;
+}
+
+uint16_t timer_ticks(void)
+{
+	uint8_t sreg = SREG;
+	uint16_t t;
+	uint8_t c;
+
+	cli();
+	c = TCNT0 - tick_ocr;
+	t = ticks;
+	SREG = sreg;
+
+	// If the interrupt is pending, or hasn't updated "ticks" yet, the
+	// counter is simply more than CLOCKS ahead of tick_ocr.
+	return t + c;
+}
+
+uint32_t timer_counter(void)
+{
+	uint8_t sreg = SREG;
+	uint32_t m;
+	uint16_t r, t;
+
+	cli();
+	m = ms;
+	r = ms_rem;
+	t = ticks;
+	SREG = sreg;
+
+	t = timer_ticks() - t;
+	return m + ((uint32_t)t*PRESCALE + r) / MS_CLOCKS;
 }
 
 void timer_init(void)
 {
-#if defined (__AVR_ATmega8__)
-#define TCCR0B TCCR0
-#else
 	TCCR0A=0;
-#endif
 #if PRESCALE==64
 	TCCR0B=0x03;
 #elif PRESCALE==256
@@ -92,28 +127,151 @@ void timer_init(void)
 #else
 #error Wrong value of PRESCALE!
 #endif
-	TCNT0=~CLOCKS;
-	TIMSK0=(1<<TOIE0);
-	TIFR0=(1<<TOV0);
+	TCNT0=0;
+	OCR0A=CLOCKS;
+	TIFR0=(1<<OCF0A);
+	TIMSK0=(1<<OCIE0A);
+}
+
+uint32_t timer_now(void)
+{
+	uint8_t sreg = SREG;
+	uint32_t c;
+
+	cli();
+	c = current;
+	SREG = sreg;
+	return c;
 }
 
+/* Scheduled calls, as a binary min-heap ordered by deadline */
+static timer_call_t *timer_heap[TIMER_CALLS];
+static uint8_t timer_heap_n;
+
+static inline char timer_before(timer_call_t *a, timer_call_t *b)
+{
+	return (int32_t)(a->when - b->when) < 0;
+}
+
+static inline void timer_heap_set(uint8_t i, timer_call_t *tc)
+{
+	timer_heap[i] = tc;
+	tc->pos = i+1;
+}
+
+static void timer_heap_up(uint8_t i, timer_call_t *tc)
+{
+	while(i) {
+		uint8_t p = (i-1)>>1;
+		if (!timer_before(tc, timer_heap[p]))
+			break;
+		timer_heap_set(i, timer_heap[p]);
+		i = p;
+	}
+	timer_heap_set(i, tc);
+}
+
+static void timer_heap_down(uint8_t i, timer_call_t *tc)
+{
+	for(;;) {
+		uint8_t c = 2*i+1;
+		if (c >= timer_heap_n)
+			break;
+		if (c+1 < timer_heap_n && timer_before(timer_heap[c+1], timer_heap[c]))
+			c++;
+		if (!timer_before(timer_heap[c], tc))
+			break;
+		timer_heap_set(i, timer_heap[c]);
+		i = c;
+	}
+	timer_heap_set(i, tc);
+}
+
+void timer_call_cancel(timer_call_t *tc)
+{
+	uint8_t i = tc->pos;
+	timer_call_t *last;
+
+	if (!i)
+		return;
+	tc->pos = 0;
+	last = timer_heap[--timer_heap_n];
+	if (--i == timer_heap_n)
+		return;
+	// move the last entry into the hole
+	if (i && timer_before(last, timer_heap[(i-1)>>1]))
+		timer_heap_up(i, last);
+	else
+		timer_heap_down(i, last);
+}
+
+void timer_call_at(timer_call_t *tc, uint32_t when)
+{
+	timer_call_cancel(tc);
+	tc->when = when;
+	if (timer_heap_n == TIMER_CALLS) // can't happen
+		return;
+	timer_heap_up(timer_heap_n++, tc);
+}
+
+void timer_call_in(timer_call_t *tc, uint32_t tenths)
+{
+	timer_call_at(tc, timer_now()+tenths);
+}
+
+uint32_t timer_call_remaining(timer_call_t *tc)
+{
+	int32_t d;
+
+	if (!tc->pos)
+		return 0;
+	d = tc->when - timer_now();
+	return (d < 0) ? 0 : d;
+}
+
+/* Run the calls which are due. The clock itself runs in the interrupt. */
 void timer_poll(void)
 {
-	/* Actually handled in interrupt. */
+	uint32_t now = timer_now();
+	timer_call_t *tc;
+
+	while(timer_heap_n && (int32_t)(now - (tc = timer_heap[0])->when) >= 0) {
+		timer_call_cancel(tc);
+		tc->fn(tc);
+	}
 }
 
-ISR(TIMER0_OVF_vect)
+/* This must not delay the 1wire interrupts, so it runs with interrupts
+ * enabled. The compare flag is cleared on entry and the next match is
+ * milliseconds away, so there's no danger of re-entering.
+ */
+ISR(TIMER0_COMPA_vect, ISR_NOBLOCK)
 {
-	TCNT0=~CLOCKS;
-	if(!--sub) {
-		current += 1;
-#if SUB2
-		sub = nsub;
-		nsub = SUB2-nsub;
-#else
-		sub = SUB;
-#endif
+	uint8_t o;
+
+	// timer_ticks() in a nested interrupt must see both, or neither.
+	cli();
+	o = tick_ocr + CLOCKS;
+	tick_ocr = o;
+	ticks += CLOCKS;
+	sei();
+	OCR0A = o + CLOCKS;
+
+	ms_rem += (uint16_t)CLOCKS*PRESCALE;
+	while(ms_rem >= MS_CLOCKS) {
+		ms_rem -= MS_CLOCKS;
+		ms++;
+		if(++ms_tenth == 100) {
+			ms_tenth = 0;
+			current += 1;
+		}
 	}
+#ifdef N_PORT_SEQ
+	port_seq_timer();
+#endif
+#ifdef N_PWM_FAST
+	pwm_fast_run();
+#endif
 }
 
 #endif // timer_h
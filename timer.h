@@ -10,6 +10,12 @@ typedef struct {
 	int16_t last;
 } timer_t;
 
+/* Timer0 prescaler. One "tick" (see timer_ticks()) is this many clocks. */
+#define TIMER_PRESCALE 256
+#define TIMER_PRESCALE_LOG2 8
+/* The timer interrupt runs every TIMER_CLOCKS ticks. */
+#define TIMER_CLOCKS 125 // timer0 is 8-bit, so <=255
+
 /* return True every sec tenth seconds */
 char timer_done(timer_t *t);
 void timer_start(int16_t sec, timer_t *t);
@@ -17,7 +23,47 @@ int16_t timer_remaining(timer_t *t);
 
 void timer_reset(timer_t *t);
 
-int16_t timer_counter(void);
+/*
+ * Scheduled calls. FN is called from the main loop (timer_poll()) once
+ * the time, in tenths of a second, reaches WHEN. Pending calls are kept
+ * in a heap, so only those that are due are looked at. Deadlines are
+ * 32-bit, so a call may be up to 2^31 tenths away.
+ *
+ * Set FN before scheduling. The call is unscheduled when FN runs; FN may
+ * schedule it again, e.g. at tc->when+interval to keep the phase.
+ */
+typedef struct timer_call timer_call_t;
+struct timer_call {
+	uint32_t when;
+	void (*fn)(timer_call_t *tc);
+	uint8_t pos; // heap index+1, zero if not scheduled
+};
+/* There's room for one per PWM, plus the console ping */
+#ifdef N_PWM
+#define TIMER_CALLS (N_PWM+1)
+#else
+#define TIMER_CALLS 1
+#endif
+
+/* Current time, in tenths of a second */
+uint32_t timer_now(void);
+void timer_call_at(timer_call_t *tc, uint32_t when);
+void timer_call_in(timer_call_t *tc, uint32_t tenths);
+void timer_call_cancel(timer_call_t *tc);
+/* Tenths of a second until TC runs; zero if it's not scheduled */
+uint32_t timer_call_remaining(timer_call_t *tc);
+static inline char timer_call_pending(timer_call_t *tc) {
+	return tc->pos != 0;
+}
+
+/* Milliseconds since startup. Exact, and monotonic until it wraps
+ * after 49 days. */
+uint32_t timer_counter(void);
+
+/* Free-running 16-bit counter, in units of TIMER_PRESCALE clock cycles.
+ * Good for measuring how long something takes; it wraps every couple of
+ * seconds, so only use differences. */
+uint16_t timer_ticks(void);
 
 /**
  * The point of 'reset_delta' is: assume every(20,&t) controls a 50% PWM output
@@ -173,6 +173,9 @@ static volatile unsigned char UART_TxHead;
 static volatile unsigned char UART_TxTail;
 static volatile unsigned char UART_RxHead;
 static volatile unsigned char UART_RxTail;
+#ifdef HAVE_UART_IRQ
+static volatile unsigned char UART_TxBusy;
+#endif
 #endif
 static volatile unsigned char UART_LastRxError;
 
@@ -241,7 +244,6 @@ Purpose:  called when the UART has received a character
     DBG(0x38);
     usr  = UART0_STATUS;
     data = UART0_DATA;
-    
     lastRxError = usr & UART0_ERRMASK;
     
     /* calculate buffer index */ 
@@ -253,11 +255,12 @@ Purpose:  called when the UART has received a character
     } else {
 	lastRxError = UART_BUFFER_OVERFLOW >> 8;
     }
+    /* Reading the data register cleared the interrupt condition, and the
+       next byte has its own place in the buffer, so let the 1wire code
+       interrupt us from now on */
+    sei();
     UART_LastRxError = lastRxError;   
     DBG(0x37);
-#ifndef HAVE_UART_IRQ
-    sei();
-#endif
 }
 
 
@@ -273,7 +276,13 @@ Purpose:  called when the UART is ready to transmit the next byte
 {
     unsigned char tmptail;
     
-#ifndef HAVE_UART_IRQ
+#ifdef HAVE_UART_IRQ
+    /* The interrupt condition persists until we write the data register.
+       Disable it while interrupts are enabled, so that we're not re-entered. */
+    UART0_CONTROL &= ~_BV(UART0_UDRIE);
+    UART_TxBusy = 1;
+    sei();
+#else
     if (!(UCSR0A & (1<<UDRE0)))
         return;
     cli();
@@ -288,14 +297,15 @@ Purpose:  called when the UART is ready to transmit the next byte
         /* get one byte from buffer and write it to UART */
         UART0_DATA = UART_TxBuf[tmptail];  /* start transmission */
         UART_TxTail = tmptail;
-    } else {
-#ifdef HAVE_UART_IRQ
-        /* tx buffer empty, disable UDRE interrupt */
-        UART0_CONTROL &= ~_BV(UART0_UDRIE);
-#endif
     }
     DBG(x);
-#ifndef HAVE_UART_IRQ
+#ifdef HAVE_UART_IRQ
+    /* re-enable the UDRE interrupt unless the tx buffer is empty */
+    cli();
+    UART_TxBusy = 0;
+    if (UART_TxHead != UART_TxTail)
+        UART0_CONTROL |= _BV(UART0_UDRIE);
+#else
     sei();
 #endif
 }
@@ -408,9 +418,10 @@ void uart_putc(unsigned char data)
         UART_TxBuf[tmphead] = data;
         UART_TxHead = tmphead;
 
-        /* enable UDRE interrupt */
+        /* enable UDRE interrupt, unless the handler is running */
 #ifdef HAVE_UART_IRQ
-        UART0_CONTROL    |= _BV(UART0_UDRIE);
+        if (!UART_TxBusy)
+            UART0_CONTROL    |= _BV(UART0_UDRIE);
 #endif
     }
 